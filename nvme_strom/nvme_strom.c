@@ -15,19 +15,26 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
  */
+#include <asm/i387.h>
 #include <asm/uaccess.h>
+#include <asm/xcr.h>
+#include <asm/xsave.h>
 #include <linux/buffer_head.h>
+#include <linux/eventfd.h>
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/kallsyms.h>
 #include <linux/kernel.h>
 #include <linux/magic.h>
 #include <linux/major.h>
+#include <linux/mempool.h>
 #include <linux/moduleparam.h>
 #include <linux/nvme.h>
 #include <linux/proc_fs.h>
 #include <linux/sched.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include <generated/utsrelease.h>
 #include "nv-p2p.h"
 #include "nvme_strom.h"
@@ -114,6 +121,8 @@ struct mapped_gpu_memory
 									 * is one of NVIDIA_P2P_PAGE_SIZE_* */
 	size_t				gpu_page_shift;	/* log2 of gpu_page_sz */
 	nvidia_p2p_page_table_t *page_table;
+	struct list_head	prp_tables;	/* list of strom_prp_table */
+	void __iomem	  **iomap_cache;/* cache of ioremap_wc() per GPU page */
 
 	/*
 	 * NOTE: User supplied virtual address of device memory may not be
@@ -139,6 +148,11 @@ struct mapped_gpu_memory
 typedef struct mapped_gpu_memory	mapped_gpu_memory;
 
 #define MAPPED_GPU_MEMORY_NSLOTS	48
+static int	prp_table_enabled = 1;
+module_param(prp_table_enabled, int, 0644);
+MODULE_PARM_DESC(prp_table_enabled,
+				 "use PRP table preliminary built for mapped GPU memory");
+
 static spinlock_t		strom_mgmem_locks[MAPPED_GPU_MEMORY_NSLOTS];
 static struct list_head	strom_mgmem_slots[MAPPED_GPU_MEMORY_NSLOTS];
 
@@ -209,6 +223,490 @@ strom_put_mapped_gpu_memory(mapped_gpu_memory *mgmem)
 	spin_unlock_irqrestore(lock, flags);
 }
 
+/*
+ * NOTE: Page table of the mapped GPU memory never changes until it is
+ * released, so we can build PRP (Physical Region Page) entries of the
+ * region preliminary, then SSD2GPU DMA requests can point a part of the
+ * entries as PRP list, without per-request allocation and setup.
+ * PRP list has to be stored in the host memory visible to the NVMe-SSD,
+ * so the table is created per NVMe device on the first DMA towards the
+ * region. Each page of the PRP table stores entries except for the last
+ * one, and the last entry of the page chains to the next page.
+ * Pages of the table are allocated on demand, when a DMA request touches
+ * the window of the GPU memory covered by the page (2MB per 4KB page), so
+ * the table consumes coherent memory only for the window actually used.
+ * The table holds a reference to the device, because it may be released
+ * after the hot-remove of the controller.
+ */
+struct strom_prp_table
+{
+	struct list_head	chain;		/* chain to mgmem->prp_tables */
+	struct nvme_dev	   *nvme_dev;	/* NVMe device to read the table */
+	struct device	   *dmadev;		/* reference to the device for DMA */
+	spinlock_t			lock;		/* lock to install the pages */
+	size_t				page_size;	/* page size of the NVMe device */
+	unsigned int		nitems;		/* number of the PRP entries */
+	unsigned int		nitems_per_page;	/* entries per page, except for
+											 * the chain to the next page */
+	unsigned int		npages;		/* number of the pages */
+	struct {
+		__le64		   *prps;		/* NULL, if not allocated yet */
+		dma_addr_t		dma_addr;
+	} pages[1];		/* variable length */
+};
+typedef struct strom_prp_table	strom_prp_table;
+
+/*
+ * __strom_free_prp_table
+ */
+static void
+__strom_free_prp_table(strom_prp_table *prp_table)
+{
+	int				i;
+
+	for (i=0; i < prp_table->npages; i++)
+	{
+		if (prp_table->pages[i].prps)
+			dma_free_coherent(prp_table->dmadev, prp_table->page_size,
+							  prp_table->pages[i].prps,
+							  prp_table->pages[i].dma_addr);
+	}
+	put_device(prp_table->dmadev);
+	vfree(prp_table);
+}
+
+/*
+ * __strom_create_prp_table - creates an empty PRP table
+ */
+static strom_prp_table *
+__strom_create_prp_table(mapped_gpu_memory *mgmem, struct nvme_dev *nvme_dev)
+{
+	nvidia_p2p_page_table_t *page_table = mgmem->page_table;
+	strom_prp_table *prp_table;
+	size_t			page_size = nvme_dev->page_size;
+	size_t			total_length;
+	unsigned int	nitems;
+	unsigned int	nitems_per_page;
+	unsigned int	npages;
+
+	/* GPU page must be aligned to the device page */
+	if (mgmem->gpu_page_sz < page_size ||
+		(mgmem->gpu_page_sz & (page_size - 1)) != 0)
+		return NULL;
+
+	total_length = ((size_t)page_table->entries << mgmem->gpu_page_shift);
+	nitems = total_length / page_size;
+	nitems_per_page = page_size / sizeof(__le64) - 1;
+	npages = DIV_ROUND_UP(nitems, nitems_per_page);
+
+	prp_table = vzalloc(offsetof(strom_prp_table, pages[npages]));
+	if (!prp_table)
+		return NULL;
+	INIT_LIST_HEAD(&prp_table->chain);
+	prp_table->nvme_dev	= nvme_dev;
+	prp_table->dmadev	= get_device(&nvme_dev->pci_dev->dev);
+	spin_lock_init(&prp_table->lock);
+	prp_table->page_size = page_size;
+	prp_table->nitems	= nitems;
+	prp_table->nitems_per_page = nitems_per_page;
+	prp_table->npages	= npages;
+
+	return prp_table;
+}
+
+/*
+ * __strom_fill_prp_page - allocates and fills up the page of PRP table,
+ * if not yet. It returns false if no memory.
+ */
+static bool
+__strom_fill_prp_page(mapped_gpu_memory *mgmem,
+					  strom_prp_table *prp_table, unsigned int index,
+					  gfp_t gfp)
+{
+	nvidia_p2p_page_table_t *page_table = mgmem->page_table;
+	size_t			page_size = prp_table->page_size;
+	unsigned int	per = prp_table->nitems_per_page;
+	unsigned int	base = index * per;
+	unsigned int	i, n;
+	unsigned long	flags;
+	dma_addr_t		dma_addr;
+	__le64		   *prps;
+
+	if (ACCESS_ONCE(prp_table->pages[index].prps))
+		return true;
+
+	prps = dma_alloc_coherent(prp_table->dmadev, page_size,
+							  &dma_addr, gfp);
+	if (!prps)
+		return false;
+	n = Min(per, prp_table->nitems - base);
+	for (i=0; i < n; i++)
+	{
+		size_t		offset = (size_t)(base + i) * page_size;
+		uint64_t	paddr;
+
+		paddr = page_table->pages[offset >> mgmem->gpu_page_shift]
+			->physical_address + (offset & (mgmem->gpu_page_sz - 1));
+		prps[i] = cpu_to_le64(paddr);
+	}
+	prps[per] = 0;
+
+	/* install the page, and chain to the neighbors */
+	spin_lock_irqsave(&prp_table->lock, flags);
+	if (prp_table->pages[index].prps)
+	{
+		/* someone installed the same page concurrently */
+		spin_unlock_irqrestore(&prp_table->lock, flags);
+		dma_free_coherent(prp_table->dmadev, page_size, prps, dma_addr);
+		return true;
+	}
+	if (index + 1 < prp_table->npages && prp_table->pages[index+1].prps)
+		prps[per] = cpu_to_le64(prp_table->pages[index+1].dma_addr);
+	if (index > 0 && prp_table->pages[index-1].prps)
+		prp_table->pages[index-1].prps[per] = cpu_to_le64(dma_addr);
+	prp_table->pages[index].dma_addr = dma_addr;
+	smp_wmb();
+	prp_table->pages[index].prps = prps;
+	spin_unlock_irqrestore(&prp_table->lock, flags);
+
+	return true;
+}
+
+/*
+ * strom_lookup_prp_table - it sets up PRP1 and PRP2 of the DMA request
+ * towards the mapped GPU memory using the preliminary built PRP table.
+ * It returns false if not available; caller has to set up PRPs by itself.
+ * Unless @gfp allows to block, it does not create a new table.
+ */
+static bool
+strom_lookup_prp_table(mapped_gpu_memory *mgmem,
+					   struct nvme_dev *nvme_dev,
+					   loff_t dest_offset, size_t length,
+					   u64 *p_prp1, u64 *p_prp2, gfp_t gfp)
+{
+	spinlock_t		   *lock = &strom_mgmem_locks[mgmem->hindex];
+	struct device	   *dmadev = &nvme_dev->pci_dev->dev;
+	strom_prp_table	   *prp_table;
+	strom_prp_table	   *prp_table_new = NULL;
+	unsigned long		flags;
+	unsigned int		first;
+	unsigned int		last;
+	unsigned int		per;
+	unsigned int		i;
+
+	if (!prp_table_enabled || length == 0)
+		return false;
+retry:
+	spin_lock_irqsave(lock, flags);
+	list_for_each_entry(prp_table, &mgmem->prp_tables, chain)
+	{
+		if (prp_table->nvme_dev == nvme_dev &&
+			prp_table->dmadev == dmadev)
+			goto found;
+	}
+	if (prp_table_new)
+	{
+		prp_table = prp_table_new;
+		prp_table_new = NULL;
+		list_add(&prp_table->chain, &mgmem->prp_tables);
+		goto found;
+	}
+	spin_unlock_irqrestore(lock, flags);
+
+	/* create a new PRP table, then retry */
+	if ((gfp & __GFP_WAIT) == 0)
+		return false;
+	prp_table_new = __strom_create_prp_table(mgmem, nvme_dev);
+	if (!prp_table_new)
+		return false;
+	goto retry;
+
+found:
+	spin_unlock_irqrestore(lock, flags);
+	if (prp_table_new)
+		__strom_free_prp_table(prp_table_new);
+
+	first = dest_offset / prp_table->page_size;
+	last = (dest_offset + length - 1) / prp_table->page_size;
+	per = prp_table->nitems_per_page;
+	if (last >= prp_table->nitems)
+		return false;
+	/*
+	 * NVMe-SSD considers the last entry of the PRP list page is the data
+	 * pointer, not a chain, if no more entries are needed. So, if the last
+	 * entry of the request is located at the head of the next page, we
+	 * cannot use the table.
+	 */
+	if (last > first + 1 && (last % per) == 0)
+		return false;
+
+	/* pages of the table to be referenced by this request */
+	for (i = first / per; i <= last / per; i++)
+	{
+		if (!__strom_fill_prp_page(mgmem, prp_table, i, gfp))
+			return false;
+	}
+	smp_rmb();
+
+	*p_prp1 = le64_to_cpu(prp_table->pages[first / per].prps[first % per])
+		+ (dest_offset & (prp_table->page_size - 1));
+	if (first == last)
+		*p_prp2 = 0;
+	else if (first + 1 == last)
+		*p_prp2 = le64_to_cpu(prp_table->pages[last / per].prps[last % per]);
+	else
+	{
+		first++;
+		*p_prp2 = (prp_table->pages[first / per].dma_addr +
+				   sizeof(__le64) * (first % per));
+	}
+	return true;
+}
+
+/*
+ * strom_release_prp_tables
+ */
+static void
+strom_release_prp_tables(mapped_gpu_memory *mgmem)
+{
+	strom_prp_table *prp_table;
+	strom_prp_table *prp_next;
+
+	list_for_each_entry_safe(prp_table, prp_next, &mgmem->prp_tables, chain)
+	{
+		list_del(&prp_table->chain);
+		__strom_free_prp_table(prp_table);
+	}
+}
+
+/*
+ * strom_get_gpu_page_iomap - write-combined mapping of the GPU page
+ *
+ * ioremap_wc() and iounmap() per copy are expensive because iounmap()
+ * involves TLB shootdown on all the CPUs. So, mapping of the GPU page is
+ * cached on the first use, and retained until the mapped GPU memory is
+ * released. Caller must hold a reference to the mapped GPU memory.
+ */
+static void __iomem *
+strom_get_gpu_page_iomap(mapped_gpu_memory *mgmem, int index)
+{
+	void __iomem   *iomap = ACCESS_ONCE(mgmem->iomap_cache[index]);
+	void __iomem   *prev;
+	uint64_t		phy_addr;
+
+	if (iomap)
+		return iomap;
+
+	phy_addr = mgmem->page_table->pages[index]->physical_address;
+	iomap = ioremap_wc(phy_addr, mgmem->gpu_page_sz);
+	if (!iomap)
+		return NULL;
+	/* someone might map the same GPU page concurrently */
+	prev = cmpxchg(&mgmem->iomap_cache[index], NULL, iomap);
+	if (prev)
+	{
+		iounmap(iomap);
+		iomap = prev;
+	}
+	return iomap;
+}
+
+/*
+ * strom_release_iomap_cache
+ */
+static void
+strom_release_iomap_cache(mapped_gpu_memory *mgmem)
+{
+	uint32_t	i;
+
+	if (!mgmem->iomap_cache)
+		return;
+	for (i=0; i < mgmem->page_table->entries; i++)
+	{
+		if (mgmem->iomap_cache[i])
+			iounmap(mgmem->iomap_cache[i]);
+	}
+	vfree(mgmem->iomap_cache);
+	mgmem->iomap_cache = NULL;
+}
+
+/*
+ * ================================================================
+ *
+ * Non-temporal copy from the host RAM to the GPU device memory
+ *
+ * ================================================================
+ */
+static int	nt_copy_enabled = 1;
+module_param(nt_copy_enabled, int, 0444);
+MODULE_PARM_DESC(nt_copy_enabled,
+				 "use non-temporal stores for RAM2GPU copy (default: on)");
+
+#define STROM_COPY_METHOD__MEMCPY_TOIO	0
+#define STROM_COPY_METHOD__MOVNTI		1
+#define STROM_COPY_METHOD__SSE2			2
+#define STROM_COPY_METHOD__AVX			3
+static int	strom_copy_method = STROM_COPY_METHOD__MEMCPY_TOIO;
+static const char *strom_copy_method_names[] = {
+	"memcpy_toio",
+	"movnti",
+	"sse2",
+	"avx",
+};
+
+/*
+ * NOTE: memcpy_toio() on x86_64 is a plain memcpy() that is optimized for
+ * the cached memory, so each store to the write-combined mapping may be
+ * flushed as a partial PCIe write. The routines below write the destination
+ * by full cachelines with non-temporal stores, so the write-combining buffer
+ * is always flushed as a 64B burst. Destination must be 64B aligned and
+ * length must be multiple of 64B; caller has to handle the rest.
+ */
+static void
+__strom_copy_movnti(char __iomem *dst, const char *src, size_t len)
+{
+	u64 __iomem	   *d = (u64 __iomem *)dst;
+	const u64	   *s = (const u64 *)src;
+	size_t			i, n = len / sizeof(u64);
+
+	for (i=0; i < n; i++)
+		asm volatile("movnti %1, %0" : "=m" (d[i]) : "r" (s[i]));
+}
+
+static void
+__strom_copy_sse2(char __iomem *dst, const char *src, size_t len)
+{
+	for (; len >= 64; dst += 64, src += 64, len -= 64)
+	{
+		asm volatile("movdqu    (%1), %%xmm0\n\t"
+					 "movdqu  16(%1), %%xmm1\n\t"
+					 "movdqu  32(%1), %%xmm2\n\t"
+					 "movdqu  48(%1), %%xmm3\n\t"
+					 "movntdq %%xmm0,   (%0)\n\t"
+					 "movntdq %%xmm1, 16(%0)\n\t"
+					 "movntdq %%xmm2, 32(%0)\n\t"
+					 "movntdq %%xmm3, 48(%0)\n\t"
+					 :
+					 : "r" (dst), "r" (src)
+					 : "memory");
+	}
+}
+
+static void
+__strom_copy_avx(char __iomem *dst, const char *src, size_t len)
+{
+	for (; len >= 64; dst += 64, src += 64, len -= 64)
+	{
+		asm volatile("vmovdqu    (%1), %%ymm0\n\t"
+					 "vmovdqu  32(%1), %%ymm1\n\t"
+					 "vmovntdq %%ymm0,   (%0)\n\t"
+					 "vmovntdq %%ymm1, 32(%0)\n\t"
+					 :
+					 : "r" (dst), "r" (src)
+					 : "memory");
+	}
+	asm volatile("vzeroupper" ::: "memory");
+}
+
+/*
+ * strom_memcpy_toio_begin / strom_memcpy_toio_end
+ *
+ * kernel_fpu_begin() saves the FPU state of the current task, so it is too
+ * expensive to call per page. Caller brackets a batch of strom_memcpy_toio()
+ * by these functions, and passes @use_simd to the copies. Preemption is
+ * disabled in between, so nothing can sleep there. The end also orders the
+ * non-temporal stores of the batch, so it is required even without SIMD.
+ */
+static inline bool
+strom_memcpy_toio_begin(void)
+{
+	if ((strom_copy_method == STROM_COPY_METHOD__AVX ||
+		 strom_copy_method == STROM_COPY_METHOD__SSE2) &&
+		irq_fpu_usable())
+	{
+		kernel_fpu_begin();
+		return true;
+	}
+	return false;
+}
+
+static inline void
+strom_memcpy_toio_end(bool use_simd)
+{
+	/* non-temporal stores are weakly ordered */
+	wmb();
+	if (use_simd)
+		kernel_fpu_end();
+}
+
+/*
+ * strom_memcpy_toio - copy to the write-combined mapping of GPU page
+ *
+ * If @use_simd, caller must be in the FPU section by strom_memcpy_toio_begin.
+ */
+static void
+strom_memcpy_toio(char __iomem *dst, const char *src, size_t len,
+				  bool use_simd)
+{
+	size_t		head;
+	size_t		body;
+
+	if (strom_copy_method == STROM_COPY_METHOD__MEMCPY_TOIO ||
+		len < 2 * L1_CACHE_BYTES)
+	{
+		memcpy_toio(dst, src, len);
+		return;
+	}
+	/* unaligned head of the destination */
+	head = (-(unsigned long)dst) & (L1_CACHE_BYTES - 1);
+	if (head > 0)
+	{
+		memcpy_toio(dst, src, head);
+		dst += head;
+		src += head;
+		len -= head;
+	}
+	/* full cachelines */
+	body = len & ~((size_t)L1_CACHE_BYTES - 1);
+	if (!use_simd)
+		__strom_copy_movnti(dst, src, body);
+	else if (strom_copy_method == STROM_COPY_METHOD__AVX)
+		__strom_copy_avx(dst, src, body);
+	else
+		__strom_copy_sse2(dst, src, body);
+	dst += body;
+	src += body;
+	len -= body;
+	/* unaligned tail */
+	if (len > 0)
+		memcpy_toio(dst, src, len);
+}
+
+/*
+ * strom_init_copy_method - choose the RAM2GPU copy routine by CPU features
+ *
+ * CPUID tells only the capability of the processor; AVX is usable only if
+ * the kernel enabled YMM state in XCR0 (not booted with noxsave, or other
+ * restricted xfeatures).
+ */
+static void
+strom_init_copy_method(void)
+{
+	if (!nt_copy_enabled)
+		strom_copy_method = STROM_COPY_METHOD__MEMCPY_TOIO;
+	else if (boot_cpu_has(X86_FEATURE_AVX) &&
+			 boot_cpu_has(X86_FEATURE_OSXSAVE) &&
+			 (xgetbv(XCR_XFEATURE_ENABLED_MASK) &
+			  (XSTATE_SSE | XSTATE_YMM)) == (XSTATE_SSE | XSTATE_YMM))
+		strom_copy_method = STROM_COPY_METHOD__AVX;
+	else if (boot_cpu_has(X86_FEATURE_XMM2))
+		strom_copy_method = STROM_COPY_METHOD__SSE2;
+	else
+		strom_copy_method = STROM_COPY_METHOD__MOVNTI;
+	prInfo("RAM2GPU copy method: %s",
+		   strom_copy_method_names[strom_copy_method]);
+}
+
 /*
  * callback_release_mapped_gpu_memory
  */
@@ -262,6 +760,8 @@ callback_release_mapped_gpu_memory(void *private)
 	 * OK, no concurrent task does not use this mapped GPU memory region
 	 * at this point. So, we can release the page table and relevant safely.
 	 */
+	strom_release_prp_tables(mgmem);
+	strom_release_iomap_cache(mgmem);
 	rc = __nvidia_p2p_free_page_table(mgmem->page_table);
 	if (rc)
 		prError("nvidia_p2p_free_page_table (handle=0x%lx, rc=%d)",
@@ -310,6 +810,8 @@ ioctl_map_gpu_memory(StromCmd__MapGpuMemory __user *uarg)
 	mgmem->map_offset	= map_offset;
 	mgmem->map_length	= map_offset + karg.length;
 	mgmem->wait_task	= NULL;
+	INIT_LIST_HEAD(&mgmem->prp_tables);
+	mgmem->iomap_cache	= NULL;
 
 	rc = __nvidia_p2p_get_pages(0,	/* p2p_token; deprecated */
 								0,	/* va_space_token; deprecated */
@@ -347,6 +849,12 @@ ioctl_map_gpu_memory(StromCmd__MapGpuMemory __user *uarg)
 
 	/* return the handle of mapped_gpu_memory */
 	entries = mgmem->page_table->entries;
+	mgmem->iomap_cache = vzalloc(sizeof(void __iomem *) * entries);
+	if (!mgmem->iomap_cache)
+	{
+		rc = -ENOMEM;
+		goto error_2;
+	}
 	if (put_user(mgmem->handle, &uarg->handle) ||
 		put_user(mgmem->gpu_page_sz, &uarg->gpu_page_sz) ||
 		put_user(entries, &uarg->gpu_npages))
@@ -385,6 +893,7 @@ ioctl_map_gpu_memory(StromCmd__MapGpuMemory __user *uarg)
 	return 0;
 
 error_2:
+	vfree(mgmem->iomap_cache);
 	__nvidia_p2p_put_pages(0, 0, mgmem->map_address, mgmem->page_table);
 error_1:
 	kfree(mgmem);
@@ -564,151 +1073,968 @@ strom_get_block(struct inode *inode, sector_t iblock,
 }
 
 /*
- * ioctl_check_file
- *
- * ioctl(2) handler for STROM_IOCTL__CHECK_FILE
- */
-static int
-ioctl_check_file(StromCmd__CheckFile __user *uarg)
-{
-	StromCmd__CheckFile karg;
-	struct file	   *filp;
-	int				rc;
-
-	if (copy_from_user(&karg, uarg, sizeof(karg)))
-		return -EFAULT;
-
-	filp = fget(karg.fdesc);
-	if (!filp)
-		return -EBADF;
-
-	rc = file_is_supported_nvme(filp, false, NULL);
-
-	fput(filp);
-
-	return (rc < 0 ? rc : 0);
-}
-
-/* ================================================================
+ * ================================================================
  *
- * Main part for SSD-to-GPU P2P DMA
+ * Extent cache of the source files
  *
  * ================================================================
  */
 
 /*
- * NOTE: It looks to us Intel 750 SSD does not accept DMA request larger
- * than 128KB. However, we are not certain whether it is restriction for
- * all the NVMe-SSD devices. Right now, 128KB is a default of the max unit
- * length of DMA request.
+ * NOTE: get_block_t of Ext4/XFS walks on the extent tree of the inode for
+ * each invocation, so we cannot ignore its cost if it is called for each
+ * pages on scan-heavy workloads. The extent cache below remembers the
+ * logical-to-physical block mapping of the source files, then allows to
+ * solve the physical location without the filesystem callback.
+ * We cannot hook truncate or write of the filesystem, so a snapshot of
+ * i_size, i_blocks, i_version, i_mtime and i_ctime is kept with the cache,
+ * and all the extents of the inode are invalidated once any of them is
+ * updated. Files opened for write are cached as well, because PostgreSQL
+ * opens relation files with O_RDWR.
+ * Truncate changes i_size and i_blocks, and punch-hole releases the blocks,
+ * so i_blocks is decreased; both of them also update the timestamps. Block
+ * reallocation by truncate and rewrite within a jiffy, to the same size and
+ * number of blocks, is detected only by i_version; it is maintained if the
+ * filesystem is mounted with i_version (always on XFS v5). Elsewhere, stale
+ * extent might point the released blocks, then P2P DMA reads unrelated data;
+ * disable the cache if the source files are rewritten in place.
+ * The snapshot is taken prior to get_block_t, and the extent is not cached
+ * if the inode is updated during the call.
  */
-#define STROM_DMA_SSD2GPU_MAXLEN		(128 * 1024)
+#define STROM_EXTENT_CACHE_NSLOTS		64
+#define STROM_EXTENT_CACHE_NITEMS		32	/* # of extents per inode */
+/* max length to be mapped by a get_block_t call */
+#define STROM_EXTENT_LOOKUP_MAXLEN		(1UL << 30)		/* 1GB */
 
-/*
- * Number of pages to be enqueued to a workqueue for asynchronous RAM2GPU
- * memcpy. Too small request will increase the task switch overhead.
- */
-#define STROM_RAM2GPU_MAXPAGES		(2048 * 1024 / PAGE_SIZE)	/* 2MB */
+static int	extent_cache_size = 1024;
+module_param(extent_cache_size, int, 0644);
+MODULE_PARM_DESC(extent_cache_size,
+				 "max number of inodes in the extent cache (0 = disabled)");
 
-struct strom_dma_task
+typedef struct strom_inode_snapshot
 {
-	struct list_head	chain;
-	unsigned long		dma_task_id;/* ID of this DMA task */
-	int					hindex;		/* index of hash slot */
-	atomic_t			refcnt;		/* reference counter */
-	bool				frozen;		/* (DEBUG) no longer newly referenced */
-	mapped_gpu_memory  *mgmem;		/* destination GPU memory segment */
-	/* reference to the backing file */
-	struct file		   *filp;		/* source file */
-	struct nvme_ns	   *nvme_ns;	/* NVMe namespace (=SCSI LUN) */
-	size_t				blocksz;	/* blocksize of this partition */
-	int					blocksz_shift;	/* log2 of 'blocksz' */
-	sector_t			start_sect;	/* first sector of the source partition */
-	sector_t			nr_sects;	/* number of sectors of the partition */
-
-	/*
-	 * status of asynchronous tasks
-	 *
-	 * MEMO: Pay attention to error status of the asynchronous tasks.
-	 * Asynchronous task may cause errors on random timing, and kernel
-	 * space wants to inform this status on the next call. On the other
-	 * hands, application may invoke ioctl(2) to reference DMA results,
-	 * but may not. So, we have to keep an error status somewhere, but
-	 * also needs to be released on appropriate timing; to avoid kernel
-	 * memory leak by rude applications.
-	 * If any errors, we attach strom_dma_task structure on file handler
-	 * used for ioctl(2). The error status shall be reclaimed on the
-	 * next time when application wait for a particular DMA task, or
-	 * this file handler is closed.
-	 */
-	long				dma_status;
-	struct file		   *ioctl_filp;
-
-	/* current virtual address mapping of GPU page */
-	char			   *dest_iomap;	/* current ioremap_wc() window */
-	unsigned int		dest_index;	/* index of the GPU memory page */
-
-	/* contiguous SSD blocks */
-	loff_t				dest_offset;/* current destination offset */
-	sector_t			src_block;	/* head of the source blocks */
-	unsigned int		nr_blocks;	/* # of the contigunous source blocks */
-	unsigned int		max_nblocks;/* upper limit of @nr_blocks */
-	/* contiguous Page caches */
-	size_t				page_ofs;	/* offset from the first page */
-	size_t				copy_len;	/* "total" length to copy */
-	unsigned int		nr_fpages;	/* number of the pending pages */
-	struct page		   *file_pages[STROM_RAM2GPU_MAXPAGES];
-};
-typedef struct strom_dma_task	strom_dma_task;
+	loff_t			i_size;
+	blkcnt_t		i_blocks;
+	u64				i_version;
+	struct timespec	i_mtime;
+	struct timespec	i_ctime;
+} strom_inode_snapshot;
+
+typedef struct strom_extent
+{
+	sector_t		iblock;		/* first logical block of the extent */
+	sector_t		lba;		/* first physical block of the extent */
+	unsigned int	nr_blocks;	/* number of the blocks in the extent */
+} strom_extent;
 
-/*
- * strom_memcpy_task - request of RAM2GPU asynchronous memcpy
- */
-struct strom_memcpy_task
+struct strom_extent_cache
 {
-	struct work_struct work;
-	strom_dma_task *dtask;
-	size_t			offset;		/* destination offset of the request */
-	size_t			copy_len;	/* total length to copy */
-	size_t			page_ofs;	/* offset of the first page */
-	unsigned int	nr_fpages;	/* number of pending pages */
-	struct page	   *file_pages[1];	/* variable length */
+	struct list_head	chain;		/* chain to strom_extent_slots[] in LRU */
+	struct super_block *i_sb;		/* identifier of the inode */
+	unsigned long		i_ino;
+	u32					i_generation;
+	strom_inode_snapshot snap;		/* to detect truncate or write */
+	unsigned int		nitems;		/* number of the valid extents */
+	unsigned int		victim;		/* next extent to be replaced */
+	strom_extent		extents[STROM_EXTENT_CACHE_NITEMS];
 };
-typedef struct strom_memcpy_task	strom_memcpy_task;
+typedef struct strom_extent_cache	strom_extent_cache;
 
-#define STROM_DMA_TASK_NSLOTS		240
-static spinlock_t		strom_dma_task_locks[STROM_DMA_TASK_NSLOTS];
-static struct list_head	strom_dma_task_slots[STROM_DMA_TASK_NSLOTS];
-static struct list_head	failed_dma_task_slots[STROM_DMA_TASK_NSLOTS];
-static wait_queue_head_t strom_dma_task_waitq[STROM_DMA_TASK_NSLOTS];
+static spinlock_t		strom_extent_locks[STROM_EXTENT_CACHE_NSLOTS];
+static struct list_head	strom_extent_slots[STROM_EXTENT_CACHE_NSLOTS];
+static int				strom_extent_nitems[STROM_EXTENT_CACHE_NSLOTS];
 
 /*
- * strom_dma_task_index
+ * strom_extent_cache_index
  */
 static inline int
-strom_dma_task_index(unsigned long dma_task_id)
+strom_extent_cache_index(struct inode *inode)
 {
-	u32		hash = arch_fast_hash(&dma_task_id, sizeof(unsigned long),
-								  0x20120106);
-	return hash % STROM_DMA_TASK_NSLOTS;
+	u32		hash = arch_fast_hash(&inode->i_ino, sizeof(unsigned long),
+								  (u32)((unsigned long)inode->i_sb));
+	return hash % STROM_EXTENT_CACHE_NSLOTS;
 }
 
 /*
- * strom_create_dma_task
+ * strom_take_inode_snapshot
  */
-static strom_dma_task *
-strom_create_dma_task(unsigned long handle,
-					  int fdesc,
-					  struct file *ioctl_filp)
+static inline void
+strom_take_inode_snapshot(struct inode *inode, strom_inode_snapshot *snap)
 {
-	mapped_gpu_memory	   *mgmem;
-	strom_dma_task		   *dtask;
-	struct file			   *filp;
+	snap->i_size	= i_size_read(inode);
+	snap->i_blocks	= ACCESS_ONCE(inode->i_blocks);
+	snap->i_version	= ACCESS_ONCE(inode->i_version);
+	snap->i_mtime	= inode->i_mtime;
+	snap->i_ctime	= inode->i_ctime;
+}
+
+static inline bool
+strom_inode_snapshot_equal(strom_inode_snapshot *a, strom_inode_snapshot *b)
+{
+	return (a->i_size == b->i_size &&
+			a->i_blocks == b->i_blocks &&
+			a->i_version == b->i_version &&
+			timespec_equal(&a->i_mtime, &b->i_mtime) &&
+			timespec_equal(&a->i_ctime, &b->i_ctime));
+}
+
+/*
+ * __strom_lookup_extent_cache - it looks up the cache entry of the inode
+ * on the hash slot. The caller must hold the lock of the slot. Entry shall
+ * be reset if inode was updated since the last lookup.
+ */
+static strom_extent_cache *
+__strom_lookup_extent_cache(struct list_head *slot, struct inode *inode)
+{
+	strom_extent_cache *ecache;
+	strom_inode_snapshot snap;
+
+	list_for_each_entry(ecache, slot, chain)
+	{
+		if (ecache->i_sb != inode->i_sb ||
+			ecache->i_ino != inode->i_ino ||
+			ecache->i_generation != inode->i_generation)
+			continue;
+
+		strom_take_inode_snapshot(inode, &snap);
+		if (!strom_inode_snapshot_equal(&ecache->snap, &snap))
+		{
+			/* file might be truncated or written; invalidate it */
+			ecache->snap	= snap;
+			ecache->nitems	= 0;
+			ecache->victim	= 0;
+		}
+		list_move(&ecache->chain, slot);
+		return ecache;
+	}
+	return NULL;
+}
+
+/*
+ * strom_insert_extent_cache
+ *
+ * @snap is the inode snapshot taken prior to the get_block_t call; if inode
+ * was updated since then, the extent might be already stale.
+ */
+static void
+strom_insert_extent_cache(struct inode *inode, strom_inode_snapshot *snap,
+						  sector_t iblock, sector_t lba,
+						  unsigned int nr_blocks)
+{
+	int					index = strom_extent_cache_index(inode);
+	spinlock_t		   *lock = &strom_extent_locks[index];
+	struct list_head   *slot = &strom_extent_slots[index];
+	strom_extent_cache *ecache;
+	strom_extent_cache *ecache_new;
+	strom_extent_cache *victim = NULL;
+	strom_extent	   *extent;
+	unsigned long		flags;
+	int					nitems_max;
+
+	/* allocation prior to the spinlock, no problem even if not used */
+	ecache_new = kmalloc(sizeof(strom_extent_cache), GFP_KERNEL);
+
+	spin_lock_irqsave(lock, flags);
+	ecache = __strom_lookup_extent_cache(slot, inode);
+	if (!ecache)
+	{
+		if (!ecache_new)
+		{
+			spin_unlock_irqrestore(lock, flags);
+			return;		/* not a fatal error, just not cached */
+		}
+		ecache = ecache_new;
+		ecache_new = NULL;
+
+		ecache->i_sb		= inode->i_sb;
+		ecache->i_ino		= inode->i_ino;
+		ecache->i_generation = inode->i_generation;
+		strom_take_inode_snapshot(inode, &ecache->snap);
+		ecache->nitems		= 0;
+		ecache->victim		= 0;
+		list_add(&ecache->chain, slot);
+
+		/* expire the least recently used inode, if slot is full */
+		nitems_max = Max(extent_cache_size / STROM_EXTENT_CACHE_NSLOTS, 1);
+		if (++strom_extent_nitems[index] > nitems_max)
+		{
+			victim = list_entry(slot->prev, strom_extent_cache, chain);
+			Assert(victim != ecache);
+			list_del(&victim->chain);
+			strom_extent_nitems[index]--;
+		}
+	}
+
+	if (!strom_inode_snapshot_equal(&ecache->snap, snap))
+	{
+		/* inode was updated during get_block_t */
+		spin_unlock_irqrestore(lock, flags);
+		kfree(victim);
+		kfree(ecache_new);
+		return;
+	}
+	if (ecache->nitems < STROM_EXTENT_CACHE_NITEMS)
+		extent = &ecache->extents[ecache->nitems++];
+	else
+	{
+		extent = &ecache->extents[ecache->victim++];
+		if (ecache->victim >= STROM_EXTENT_CACHE_NITEMS)
+			ecache->victim = 0;
+	}
+	extent->iblock		= iblock;
+	extent->lba			= lba;
+	extent->nr_blocks	= nr_blocks;
+	spin_unlock_irqrestore(lock, flags);
+
+	kfree(victim);
+	kfree(ecache_new);
+}
+
+/*
+ * strom_lookup_extent - it solves the physical block number of the supplied
+ * logical block, and number of the blocks physically contiguous from here.
+ * If extent cache does not know the block, it asks the filesystem to map
+ * the largest extent as possible. Elsewhere, if extent cache is disabled,
+ * it asks the mapping for @length bytes at most; caller's request shall be
+ * satisfied with a single get_block_t call unless file is fragmented.
+ * If @nowait, it returns -EAGAIN instead of the filesystem callback.
+ */
+static int
+strom_lookup_extent(struct inode *inode, sector_t iblock, size_t length,
+					sector_t *p_lba, unsigned int *p_nr_blocks, bool nowait)
+{
+	unsigned int		i_blkbits = inode->i_blkbits;
+	struct buffer_head	bh;
+	loff_t				fpos = ((loff_t)iblock << i_blkbits);
+	loff_t				i_size;
+	unsigned int		nr_blocks;
+	strom_inode_snapshot snap;
+	bool				use_cache;
+	int					retval;
+
+	use_cache = (extent_cache_size > 0);
+	if (use_cache)
+	{
+		int					index = strom_extent_cache_index(inode);
+		spinlock_t		   *lock = &strom_extent_locks[index];
+		struct list_head   *slot = &strom_extent_slots[index];
+		strom_extent_cache *ecache;
+		unsigned long		flags;
+		int					i;
+
+		spin_lock_irqsave(lock, flags);
+		ecache = __strom_lookup_extent_cache(slot, inode);
+		for (i=0; ecache && i < ecache->nitems; i++)
+		{
+			strom_extent   *extent = &ecache->extents[i];
+
+			if (iblock >= extent->iblock &&
+				iblock <  extent->iblock + extent->nr_blocks)
+			{
+				*p_lba = extent->lba + (iblock - extent->iblock);
+				*p_nr_blocks = extent->nr_blocks - (iblock - extent->iblock);
+				spin_unlock_irqrestore(lock, flags);
+				return 0;
+			}
+		}
+		spin_unlock_irqrestore(lock, flags);
+	}
+
+	/* cache miss, so ask the filesystem; it may block */
+	if (nowait)
+		return -EAGAIN;
+	i_size = round_up(i_size_read(inode), (1UL << i_blkbits));
+	if (fpos >= i_size)
+		return -ERANGE;
+
+	if (!use_cache)
+		length = round_up(Max(length, 1UL), (1UL << i_blkbits));
+	else
+		length = STROM_EXTENT_LOOKUP_MAXLEN;
+
+	/* see the note above */
+	strom_take_inode_snapshot(inode, &snap);
+	memset(&bh, 0, sizeof(bh));
+	bh.b_size = Min(i_size - fpos, length);
+	retval = strom_get_block(inode, iblock, &bh, 0);
+	if (retval)
+	{
+		prDebug("strom_get_block() = %d", retval);
+		return retval;
+	}
+	nr_blocks = (bh.b_size >> i_blkbits);
+	if (!buffer_mapped(&bh) || nr_blocks == 0)
+	{
+		prError("no physical blocks are mapped at ino=%lu iblock=%lu",
+				inode->i_ino, (unsigned long)iblock);
+		return -ENODATA;
+	}
+	/*
+	 * Unwritten extent is allocated but not initialized yet, so it shall be
+	 * read as zero. P2P DMA would expose the stale contents on the device,
+	 * thus, we handle it like a hole.
+	 */
+	if (buffer_unwritten(&bh))
+	{
+		prError("unwritten extent is mapped at ino=%lu iblock=%lu",
+				inode->i_ino, (unsigned long)iblock);
+		return -ENODATA;
+	}
+	if (use_cache)
+		strom_insert_extent_cache(inode, &snap, iblock,
+								  bh.b_blocknr, nr_blocks);
+
+	*p_lba = bh.b_blocknr;
+	*p_nr_blocks = nr_blocks;
+
+	return 0;
+}
+
+/*
+ * strom_cleanup_extent_cache - release all the extent cache
+ */
+static void
+strom_cleanup_extent_cache(void)
+{
+	strom_extent_cache *ecache;
+	strom_extent_cache *enext;
+	unsigned long		flags;
+	int					i;
+
+	for (i=0; i < STROM_EXTENT_CACHE_NSLOTS; i++)
+	{
+		spin_lock_irqsave(&strom_extent_locks[i], flags);
+		list_for_each_entry_safe(ecache, enext, &strom_extent_slots[i], chain)
+		{
+			list_del(&ecache->chain);
+			kfree(ecache);
+		}
+		strom_extent_nitems[i] = 0;
+		spin_unlock_irqrestore(&strom_extent_locks[i], flags);
+	}
+}
+
+/*
+ * ioctl_check_file
+ *
+ * ioctl(2) handler for STROM_IOCTL__CHECK_FILE
+ */
+static int
+ioctl_check_file(StromCmd__CheckFile __user *uarg)
+{
+	StromCmd__CheckFile karg;
+	struct file	   *filp;
+	int				rc;
+
+	if (copy_from_user(&karg, uarg, sizeof(karg)))
+		return -EFAULT;
+
+	filp = fget(karg.fdesc);
+	if (!filp)
+		return -EBADF;
+
+	rc = file_is_supported_nvme(filp, false, NULL);
+
+	fput(filp);
+
+	return (rc < 0 ? rc : 0);
+}
+
+/* ================================================================
+ *
+ * Main part for SSD-to-GPU P2P DMA
+ *
+ * ================================================================
+ */
+
+/*
+ * NOTE: Max unit length of DMA request is derived from the max_hw_sectors
+ * of the request queue, which is computed from MDTS (Maximum Data Transfer
+ * Size) of the controller. However, it looks to us Intel 750 SSD does not
+ * accept DMA request larger than 128KB regardless of its MDTS, so we allow
+ * to override the limit by the module parameter for such broken drives.
+ * 128KB is used if the request queue does not tell us the limit.
+ */
+#define STROM_DMA_SSD2GPU_MAXLEN		(128 * 1024)
+
+static int	max_dma_length = 0;
+module_param(max_dma_length, int, 0644);
+MODULE_PARM_DESC(max_dma_length,
+				 "max length of a SSD2GPU DMA request in bytes (0 = MDTS)");
+
+/*
+ * strom_max_dma_nblocks - upper limit of the blocks per NVMe command
+ */
+static unsigned int
+strom_max_dma_nblocks(struct nvme_ns *nvme_ns, int blocksz_shift)
+{
+	size_t		max_length;
+
+	if (max_dma_length > 0)
+		max_length = max_dma_length;
+	else
+	{
+		max_length = ((size_t)queue_max_hw_sectors(nvme_ns->queue) << 9);
+		if (max_length == 0)
+			max_length = STROM_DMA_SSD2GPU_MAXLEN;
+	}
+	/* 'length' field of NVMe read command is 16bit width */
+	max_length = Min(max_length, (0x10000UL << nvme_ns->lba_shift));
+	/* at least a page shall be sent by a DMA request */
+	max_length = Max(max_length, PAGE_CACHE_SIZE);
+
+	return (max_length >> blocksz_shift);
+}
+
+/*
+ * Number of pages to be enqueued to a workqueue for asynchronous RAM2GPU
+ * memcpy. Too small request will increase the task switch overhead.
+ */
+#define STROM_RAM2GPU_MAXPAGES		(2048 * 1024 / PAGE_SIZE)	/* 2MB */
+
+struct strom_dma_task
+{
+	struct list_head	chain;		/* chain to strom_dma_task_slots[] */
+	struct list_head	failed_chain;/* chain to failed_dma_task_slots[] */
+	struct list_head	fcontext_chain;/* chain to fcontext->failed_tasks */
+	struct rcu_head		rcu;		/* to release after RCU grace period */
+	unsigned long		dma_task_id;/* ID of this DMA task */
+	int					hindex;		/* index of hash slot */
+	atomic_t			refcnt;		/* reference counter */
+	bool				frozen;		/* (DEBUG) no longer newly referenced */
+	bool				cancelled;	/* cancel is requested */
+	bool				use_ram2gpu;/* cached pages of the current chunk
+									 * are copied by RAM2GPU */
+	bool				overdue;	/* already reported by the watchdog */
+	unsigned long		start_time;	/* jiffies when DMA task is created */
+	mapped_gpu_memory  *mgmem;		/* destination GPU memory segment */
+	/* reference to the backing file */
+	struct file		   *filp;		/* source file */
+	struct nvme_ns	   *nvme_ns;	/* NVMe namespace (=SCSI LUN) */
+	size_t				blocksz;	/* blocksize of this partition */
+	int					blocksz_shift;	/* log2 of 'blocksz' */
+	sector_t			start_sect;	/* first sector of the source partition */
+	sector_t			nr_sects;	/* number of sectors of the partition */
+
+	/*
+	 * status of asynchronous tasks
+	 *
+	 * MEMO: Pay attention to error status of the asynchronous tasks.
+	 * Asynchronous task may cause errors on random timing, and kernel
+	 * space wants to inform this status on the next call. On the other
+	 * hands, application may invoke ioctl(2) to reference DMA results,
+	 * but may not. So, we have to keep an error status somewhere, but
+	 * also needs to be released on appropriate timing; to avoid kernel
+	 * memory leak by rude applications.
+	 * If any errors, we attach strom_dma_task structure on file handler
+	 * used for ioctl(2). The error status shall be reclaimed on the
+	 * next time when application wait for a particular DMA task, or
+	 * this file handler is closed.
+	 */
+	long				dma_status;
+	struct file		   *ioctl_filp;
+	struct strom_file_context *fcontext;	/* ioctl_filp->private_data */
+	/*
+	 * DMA task of the synchronous fast path is not tracked by the hash
+	 * slots. The waiter holds a reference, and @sync_done is completed
+	 * once the other references are dropped. The last reference releases
+	 * the resources, so the waiter can abandon the task on fatal signal.
+	 */
+	bool				untracked;
+	struct completion	sync_done;
+
+	/* contiguous SSD blocks */
+	loff_t				dest_offset;/* current destination offset */
+	sector_t			src_block;	/* head of the source blocks */
+	unsigned int		nr_blocks;	/* # of the contigunous source blocks */
+	unsigned int		max_nblocks;/* upper limit of @nr_blocks */
+	/* contiguous Page caches */
+	size_t				page_ofs;	/* offset from the first page */
+	size_t				copy_len;	/* "total" length to copy */
+	unsigned int		nr_fpages;	/* number of the pending pages */
+	int					submit_cpu;	/* last CPU to submit DMA request */
+	struct strom_ssd2gpu_dispatch *dispatch; /* pending requests to be
+									 * submitted on @submit_cpu */
+	struct nvme_queue  *db_nvmeq;	/* queue with the pending doorbell */
+	struct nvme_queue  *poll_nvmeq;	/* queue to be polled on completion */
+	bool				no_polling;	/* requests not on @poll_nvmeq */
+	unsigned int		db_pending;	/* # of commands not notified yet */
+	/* statistics */
+	unsigned int		nr_dma_submit;	/* # of SSD2GPU DMA submit */
+	unsigned int		nr_dma_blocks;	/* # of SSD2GPU DMA blocks */
+	sector_t			src_block_min;	/* range of the source blocks */
+	sector_t			src_block_max;	/* submitted by SSD2GPU DMA */
+	size_t				nr_bytes;		/* total length to be copied */
+	/*
+	 * staging buffer of the page caches; it is only available during
+	 * submission of the asynchronous jobs, then released.
+	 */
+	struct page		  **file_pages;
+};
+typedef struct strom_dma_task	strom_dma_task;
+
+/*
+ * strom_memcpy_task - request of RAM2GPU asynchronous memcpy
+ *
+ * A job of the default split (GPU page size) has only a few pages, so its
+ * object is allocated from the pool sized to STROM_MEMCPY_TASK_NPAGES.
+ * Larger jobs, by @ram2gpu_split_size, take the STROM_RAM2GPU_MAXPAGES one.
+ */
+#define STROM_MEMCPY_TASK_NPAGES	(64 * 1024 / PAGE_SIZE)	/* 64KB */
+
+struct strom_memcpy_task
+{
+	struct work_struct work;
+	strom_dma_task *dtask;
+	size_t			offset;		/* destination offset of the request */
+	size_t			copy_len;	/* total length to copy */
+	size_t			page_ofs;	/* offset of the first page */
+	unsigned int	nr_fpages;	/* number of pending pages */
+	struct page	   *file_pages[1];	/* variable length */
+};
+typedef struct strom_memcpy_task	strom_memcpy_task;
+
+/*
+ * ================================================================
+ *
+ * Memory pools of the DMA task and relevant objects
+ *
+ * ================================================================
+ */
+
+/*
+ * NOTE: strom_dma_task, strom_ssd2gpu_request and strom_memcpy_task are
+ * allocated and released for each ioctl(2), NVMe command or RAM2GPU copy.
+ * They are allocated from the dedicated slab caches, backed by mempools;
+ * so a temporary memory pressure does not fail the scan in progress.
+ * Number of the reserved objects per pool is configurable, and statistics
+ * of the pools are shown on the /proc/nvme-strom, to size the pools.
+ *
+ * hit      ... # of objects allocated from the slab cache
+ * miss     ... # of failed allocations from the slab cache; the pool then
+ *              gives a reserved object, or the caller waits for the one
+ *              released, or gets NULL if it cannot wait.
+ * reserved ... # of objects given from the reserved ones
+ * Prefill of the reserved objects on creation of the pool is not counted.
+ */
+static int	mempool_nr_reserved = 64;
+module_param(mempool_nr_reserved, int, 0444);
+MODULE_PARM_DESC(mempool_nr_reserved,
+				 "# of objects reserved in the memory pools");
+
+struct strom_mempool
+{
+	const char		   *name;
+	struct kmem_cache  *cachep;
+	mempool_t		   *pool;
+	atomic64_t			nr_alloc;	/* # of allocation from the pool */
+	atomic64_t			nr_hit;		/* # of allocation from the slab */
+	atomic64_t			nr_miss;	/* # of failed allocation from the slab */
+};
+typedef struct strom_mempool	strom_mempool;
+
+static strom_mempool	strom_dma_task_mempool = { .name = "strom_dma_task" };
+static strom_mempool	strom_ssd2gpu_req_mempool = { .name = "strom_ssd2gpu_request" };
+static strom_mempool	strom_memcpy_task_mempool = { .name = "strom_memcpy_task" };
+static strom_mempool	strom_memcpy_task_large_mempool =
+	{ .name = "strom_memcpy_task_large" };
+static strom_mempool	strom_file_pages_mempool = { .name = "strom_file_pages" };
+
+static void *
+strom_mempool_alloc_fn(gfp_t gfp_mask, void *private)
+{
+	strom_mempool  *smp = private;
+	void		   *obj = kmem_cache_alloc(smp->cachep, gfp_mask);
+
+	if (obj)
+		atomic64_inc(&smp->nr_hit);
+	else
+		atomic64_inc(&smp->nr_miss);
+	return obj;
+}
+
+static void
+strom_mempool_free_fn(void *element, void *private)
+{
+	strom_mempool  *smp = private;
+
+	kmem_cache_free(smp->cachep, element);
+}
+
+static inline void *
+__strom_mempool_alloc(strom_mempool *smp, gfp_t gfp_mask)
+{
+	void   *obj = mempool_alloc(smp->pool, gfp_mask);
+
+	if (obj)
+		atomic64_inc(&smp->nr_alloc);
+	return obj;
+}
+
+static inline void *
+strom_mempool_alloc(strom_mempool *smp)
+{
+	return __strom_mempool_alloc(smp, GFP_KERNEL);
+}
+
+static inline void *
+strom_mempool_alloc_nowait(strom_mempool *smp)
+{
+	return __strom_mempool_alloc(smp, GFP_NOWAIT);
+}
+
+static inline void
+strom_mempool_free(strom_mempool *smp, void *element)
+{
+	mempool_free(element, smp->pool);
+}
+
+/*
+ * strom_memcpy_task_pool - pool of strom_memcpy_task for @nr_fpages
+ */
+static inline strom_mempool *
+strom_memcpy_task_pool(unsigned int nr_fpages)
+{
+	Assert(nr_fpages <= STROM_RAM2GPU_MAXPAGES);
+	if (nr_fpages <= STROM_MEMCPY_TASK_NPAGES)
+		return &strom_memcpy_task_mempool;
+	return &strom_memcpy_task_large_mempool;
+}
+
+/*
+ * strom_destroy_mempool
+ */
+static void
+strom_destroy_mempool(strom_mempool *smp)
+{
+	if (smp->pool)
+		mempool_destroy(smp->pool);
+	if (smp->cachep)
+		kmem_cache_destroy(smp->cachep);
+	smp->pool = NULL;
+	smp->cachep = NULL;
+}
+
+/*
+ * strom_create_mempool
+ */
+static int
+strom_create_mempool(strom_mempool *smp, size_t size)
+{
+	smp->cachep = kmem_cache_create(smp->name, size, 0,
+									SLAB_HWCACHE_ALIGN, NULL);
+	if (!smp->cachep)
+		return -ENOMEM;
+	smp->pool = mempool_create(Max(mempool_nr_reserved, 1),
+							   strom_mempool_alloc_fn,
+							   strom_mempool_free_fn,
+							   smp);
+	if (!smp->pool)
+	{
+		strom_destroy_mempool(smp);
+		return -ENOMEM;
+	}
+	/* prefill of the reserved objects is not counted */
+	atomic64_set(&smp->nr_alloc, 0);
+	atomic64_set(&smp->nr_hit, 0);
+	atomic64_set(&smp->nr_miss, 0);
+	return 0;
+}
+
+/*
+ * strom_mempool_stat - write out statistics of the pool
+ */
+static int
+strom_mempool_stat(strom_mempool *smp, char *buf, size_t bufsz)
+{
+	long long	nr_alloc = atomic64_read(&smp->nr_alloc);
+	long long	nr_hit = atomic64_read(&smp->nr_hit);
+
+	/* objects not from the slab were given from the reserved ones */
+	return scnprintf(buf, bufsz,
+					 "mempool(%s): hit=%lld miss=%lld reserved=%lld\n",
+					 smp->name, nr_hit,
+					 (long long)atomic64_read(&smp->nr_miss),
+					 Max(nr_alloc - nr_hit, 0LL));
+}
+
+/*
+ * strom_event_ring - completion ring attached on the ioctl file handler
+ *
+ * The strom_completion_ring is allocated by vmalloc_user(), then mmap(2)'ed
+ * by the application as read-only area. Kernel keeps its own copy of the
+ * tail position, so it is never affected by the userspace.
+ */
+typedef struct strom_event_ring
+{
+	spinlock_t		lock;
+	uint32_t		tail;		/* number of events posted */
+	uint32_t		mask;		/* nr_entries - 1 */
+	size_t			length;		/* length of the mapped area */
+	strom_completion_ring *uring;
+} strom_event_ring;
+
+#define STROM_EVENT_RING_MAX_ENTRIES	65536
+
+/*
+ * strom_file_context - private state of the ioctl file handler
+ *
+ * Completion of the DMA tasks issued on the file handler is notified
+ * through the completion ring and/or the eventfd, if any.
+ */
+typedef struct strom_file_context
+{
+	strom_event_ring   *ering;		/* completion ring, if any */
+	struct eventfd_ctx *efd_ctx;	/* eventfd to be signaled, if any */
+	/* failed DMA tasks issued on this file handler, in LRU order */
+	spinlock_t			lock;
+	struct list_head	failed_tasks;
+	int					nr_failed;
+} strom_file_context;
+
+/*
+ * strom_notify_completion
+ */
+static void
+strom_notify_completion(struct file *ioctl_filp,
+						unsigned long dma_task_id,
+						long dma_status,
+						size_t nr_bytes)
+{
+	strom_file_context *fcontext = ioctl_filp->private_data;
+	strom_event_ring   *ering = ACCESS_ONCE(fcontext->ering);
+	struct eventfd_ctx *efd_ctx = ACCESS_ONCE(fcontext->efd_ctx);
+	unsigned long		flags;
+
+	if (ering)
+	{
+		strom_completion_event *event;
+
+		spin_lock_irqsave(&ering->lock, flags);
+		event = &ering->uring->events[ering->tail & ering->mask];
+		event->dma_task_id	= dma_task_id;
+		event->status		= dma_status;
+		event->nr_bytes		= nr_bytes;
+		/* event must be visible prior to the tail */
+		smp_wmb();
+		ering->uring->tail	= ++ering->tail;
+		spin_unlock_irqrestore(&ering->lock, flags);
+	}
+	/* eventfd_signal() is safe in the interrupt context also */
+	if (efd_ctx)
+		eventfd_signal(efd_ctx, 1);
+}
+
+/*
+ * ioctl(2) handler for STROM_IOCTL__SETUP_COMPLETION_RING
+ */
+static int
+ioctl_setup_completion_ring(StromCmd__SetupCompletionRing __user *uarg,
+							struct file *ioctl_filp)
+{
+	StromCmd__SetupCompletionRing karg;
+	strom_file_context *fcontext = ioctl_filp->private_data;
+	strom_event_ring *ering;
+
+	if (copy_from_user(&karg, uarg, sizeof(StromCmd__SetupCompletionRing)))
+		return -EFAULT;
+	if (karg.nr_entries == 0 ||
+		karg.nr_entries > STROM_EVENT_RING_MAX_ENTRIES ||
+		(karg.nr_entries & (karg.nr_entries - 1)) != 0)
+		return -EINVAL;
+
+	ering = kzalloc(sizeof(strom_event_ring), GFP_KERNEL);
+	if (!ering)
+		return -ENOMEM;
+	spin_lock_init(&ering->lock);
+	ering->tail = 0;
+	ering->mask = karg.nr_entries - 1;
+	ering->length = PAGE_ALIGN(offsetof(strom_completion_ring,
+										events[karg.nr_entries]));
+	ering->uring = vmalloc_user(ering->length);
+	if (!ering->uring)
+	{
+		kfree(ering);
+		return -ENOMEM;
+	}
+	ering->uring->tail = 0;
+	ering->uring->nr_entries = karg.nr_entries;
+	ering->uring->mask = ering->mask;
+
+	/* only one completion ring per file handler */
+	if (cmpxchg(&fcontext->ering, NULL, ering) != NULL)
+	{
+		vfree(ering->uring);
+		kfree(ering);
+		return -EBUSY;
+	}
+
+	karg.mmap_length = ering->length;
+	if (copy_to_user(uarg, &karg, sizeof(StromCmd__SetupCompletionRing)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * ioctl(2) handler for STROM_IOCTL__SETUP_EVENTFD
+ */
+static int
+ioctl_setup_eventfd(StromCmd__SetupEventFd __user *uarg,
+					struct file *ioctl_filp)
+{
+	StromCmd__SetupEventFd karg;
+	strom_file_context *fcontext = ioctl_filp->private_data;
+	struct eventfd_ctx *efd_ctx;
+
+	if (copy_from_user(&karg, uarg, sizeof(StromCmd__SetupEventFd)))
+		return -EFAULT;
+	efd_ctx = eventfd_ctx_fdget(karg.fdesc);
+	if (IS_ERR(efd_ctx))
+		return PTR_ERR(efd_ctx);
+
+	/* only one eventfd per file handler */
+	if (cmpxchg(&fcontext->efd_ctx, NULL, efd_ctx) != NULL)
+	{
+		eventfd_ctx_put(efd_ctx);
+		return -EBUSY;
+	}
+	return 0;
+}
+
+/*
+ * strom_mmap_completion_ring - mmap(2) handler of the completion ring
+ */
+static int
+strom_mmap_completion_ring(struct file *filp, struct vm_area_struct *vma)
+{
+	strom_file_context *fcontext = filp->private_data;
+	strom_event_ring   *ering = ACCESS_ONCE(fcontext->ering);
+
+	if (!ering)
+		return -EINVAL;
+	if (vma->vm_pgoff != 0 ||
+		vma->vm_end - vma->vm_start != ering->length)
+		return -EINVAL;
+	/* completion ring is read-only for userspace */
+	if ((vma->vm_flags & VM_WRITE) != 0)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, ering->uring, 0);
+}
+
+/*
+ * strom_release_file_context
+ */
+static void
+strom_release_file_context(struct file *filp)
+{
+	strom_file_context *fcontext = filp->private_data;
+
+	if (fcontext->ering)
+	{
+		vfree(fcontext->ering->uring);
+		kfree(fcontext->ering);
+	}
+	if (fcontext->efd_ctx)
+		eventfd_ctx_put(fcontext->efd_ctx);
+	kfree(fcontext);
+	filp->private_data = NULL;
+}
+
+#define STROM_DMA_TASK_NSLOTS		240
+static spinlock_t		strom_dma_task_locks[STROM_DMA_TASK_NSLOTS];
+static struct list_head	strom_dma_task_slots[STROM_DMA_TASK_NSLOTS];
+static struct list_head	failed_dma_task_slots[STROM_DMA_TASK_NSLOTS];
+static wait_queue_head_t strom_dma_task_waitq[STROM_DMA_TASK_NSLOTS];
+
+/*
+ * strom_dma_task_waiter - an entry of strom_dma_task_waitq
+ *
+ * Completion of DMA task wakes up the hashed waitqueue with its ID as
+ * a key, so only waiters for that exact DMA task are woken up.
+ */
+typedef struct strom_dma_task_waiter
+{
+	wait_queue_t		wait;
+	unsigned long		dma_task_id;
+} strom_dma_task_waiter;
+
+static int
+strom_dma_task_wake_function(wait_queue_t *wait, unsigned mode,
+							 int sync, void *key)
+{
+	strom_dma_task_waiter *waiter
+		= container_of(wait, strom_dma_task_waiter, wait);
+
+	if (key && (unsigned long)key != waiter->dma_task_id)
+		return 0;
+	return autoremove_wake_function(wait, mode, sync, key);
+}
+
+static inline void
+strom_init_dma_task_waiter(strom_dma_task_waiter *waiter,
+						   unsigned long dma_task_id)
+{
+	init_wait(&waiter->wait);
+	waiter->wait.func = strom_dma_task_wake_function;
+	waiter->dma_task_id = dma_task_id;
+}
+
+/*
+ * Sequence of dma_task_id
+ *
+ * dma_task_id is a 64bit sequence number, never reused until module reload.
+ * So, stale ID never points another DMA task, and it exposes no kernel
+ * address to userspace.
+ */
+static atomic64_t		strom_dma_task_seq = ATOMIC64_INIT(0);
+
+/*
+ * strom_dma_task_index
+ *
+ * Because dma_task_id is sequential, it distributes DMA tasks evenly.
+ */
+static inline int
+strom_dma_task_index(unsigned long dma_task_id)
+{
+	return dma_task_id % STROM_DMA_TASK_NSLOTS;
+}
+
+/*
+ * strom_free_dma_task
+ *
+ * Lookup of the running DMA tasks walks on the strom_dma_task_slots[]
+ * without locks, so DMA task must be released after RCU grace period.
+ */
+static void
+__strom_free_dma_task_rcu(struct rcu_head *rcu)
+{
+	strom_dma_task *dtask = container_of(rcu, strom_dma_task, rcu);
+
+	strom_mempool_free(&strom_dma_task_mempool, dtask);
+}
+
+static inline void
+strom_free_dma_task(strom_dma_task *dtask)
+{
+	call_rcu(&dtask->rcu, __strom_free_dma_task_rcu);
+}
+
+/*
+ * strom_init_dma_task - set up the DMA task, except for its identity
+ */
+static long
+strom_init_dma_task(strom_dma_task *dtask,
+					unsigned long handle,
+					int fdesc)
+{
+	mapped_gpu_memory	   *mgmem;
+	struct file			   *filp;
 	struct super_block	   *i_sb;
 	struct block_device	   *s_bdev;
 	struct nvme_ns		   *nvme_ns;
 	long					retval;
-	unsigned long			flags;
 
 	/* ensure the source file is supported */
 	filp = fget(fdesc);
@@ -716,12 +2042,14 @@ strom_create_dma_task(unsigned long handle,
 	{
 		prError("file descriptor %d of process %u is not available",
 				fdesc, current->tgid);
-		retval = -EBADF;
-		goto error_0;
+		return -EBADF;
 	}
 	retval = file_is_supported_nvme(filp, false, &nvme_ns);
 	if (retval < 0)
-		goto error_1;
+	{
+		fput(filp);
+		return retval;
+	}
 	i_sb = filp->f_inode->i_sb;
 	s_bdev = i_sb->s_bdev;
 
@@ -729,53 +2057,151 @@ strom_create_dma_task(unsigned long handle,
 	mgmem = strom_get_mapped_gpu_memory(handle);
 	if (!mgmem)
 	{
-		retval = -ENOENT;
-		goto error_1;
+		fput(filp);
+		return -ENOENT;
 	}
 
-	/* allocate strom_dma_task object */
-	dtask = kzalloc(sizeof(strom_dma_task), GFP_KERNEL);
-	if (!dtask)
-	{
-		retval = -ENOMEM;
-		goto error_2;
-	}
-	dtask->dma_task_id	= (unsigned long) dtask;
-	dtask->hindex		= strom_dma_task_index(dtask->dma_task_id);
-    atomic_set(&dtask->refcnt, 1);
+	dtask->cancelled	= false;
+	dtask->use_ram2gpu	= false;
+	dtask->overdue		= false;
+	dtask->start_time	= jiffies;
+	atomic_set(&dtask->refcnt, 1);
 	dtask->frozen		= false;
-    dtask->mgmem		= mgmem;
-    dtask->filp			= filp;
+	dtask->mgmem		= mgmem;
+	dtask->filp			= filp;
 	dtask->nvme_ns		= nvme_ns;
 	dtask->blocksz		= i_sb->s_blocksize;
 	dtask->blocksz_shift = i_sb->s_blocksize_bits;
 	Assert(dtask->blocksz == (1UL << dtask->blocksz_shift));
 	dtask->start_sect	= s_bdev->bd_part->start_sect;
 	dtask->nr_sects		= s_bdev->bd_part->nr_sects;
-    dtask->dma_status	= 0;
-    dtask->ioctl_filp	= get_file(ioctl_filp);
+	dtask->dma_status	= 0;
+	dtask->untracked	= false;
 
 	dtask->dest_offset	= 0;
 	dtask->src_block	= 0;
 	dtask->nr_blocks	= 0;
-	dtask->max_nblocks = STROM_DMA_SSD2GPU_MAXLEN >> dtask->blocksz_shift;
+	dtask->max_nblocks	= strom_max_dma_nblocks(nvme_ns,
+												dtask->blocksz_shift);
 	dtask->page_ofs		= 0;
 	dtask->copy_len		= 0;
 	dtask->nr_fpages	= 0;
+	dtask->submit_cpu	= raw_smp_processor_id();
+	dtask->dispatch		= NULL;
+	dtask->db_nvmeq		= NULL;
+	dtask->db_pending	= 0;
+	dtask->poll_nvmeq	= NULL;
+	dtask->no_polling	= false;
+	dtask->nr_dma_submit = 0;
+	dtask->nr_dma_blocks = 0;
+	dtask->src_block_min = 0;
+	dtask->src_block_max = 0;
+	dtask->nr_bytes		= 0;
 
-    /* OK, this strom_dma_task is now tracked */
-	spin_lock_irqsave(&strom_dma_task_locks[dtask->hindex], flags);
-	list_add_rcu(&dtask->chain, &strom_dma_task_slots[dtask->hindex]);
-    spin_unlock_irqrestore(&strom_dma_task_locks[dtask->hindex], flags);
+	return 0;
+}
 
-	return dtask;
+/*
+ * DMA task watchdog
+ *
+ * It reports DMA tasks not completed within the dma_task_deadline, for
+ * investigation of the stuck NVMe-SSD. Once reported, it is not reported
+ * again. It rearms itself only while any DMA task is running and the
+ * dma_task_deadline is set; the next DMA task restarts the watchdog.
+ * Pending bit of the work is cleared prior to its execution, so a DMA task
+ * created during the scan also rearms it.
+ */
+static int	dma_task_deadline = 60;
+module_param(dma_task_deadline, int, 0644);
+MODULE_PARM_DESC(dma_task_deadline,
+				 "deadline in seconds to report DMA tasks not completed "
+				 "(0 = disabled)");
 
-error_2:
-	strom_put_mapped_gpu_memory(mgmem);
-error_1:
-	fput(filp);
-error_0:
-	return ERR_PTR(retval);
+static struct delayed_work	strom_dma_task_watchdog_work;
+
+static void
+strom_dma_task_watchdog(struct work_struct *work)
+{
+	int			deadline = dma_task_deadline;
+	int			nr_running = 0;
+	int			i;
+
+	for (i=0; deadline > 0 && i < STROM_DMA_TASK_NSLOTS; i++)
+	{
+		struct list_head   *slot = &strom_dma_task_slots[i];
+		strom_dma_task	   *dtask;
+
+		rcu_read_lock();
+		list_for_each_entry_rcu(dtask, slot, chain)
+		{
+			int		shift = dtask->blocksz_shift - 9;
+
+			nr_running++;
+			if (dtask->overdue ||
+				time_before(jiffies, (dtask->start_time +
+									  (unsigned long)deadline * HZ)))
+				continue;
+			dtask->overdue = true;
+			prError("DMA task (id=%lu) is not completed in %d sec; "
+					"%s sector %llu-%llu, %u requests, %u blocks",
+					dtask->dma_task_id, deadline,
+					dtask->nvme_ns->disk->disk_name,
+					(unsigned long long)((dtask->src_block_min << shift) +
+										 dtask->start_sect),
+					(unsigned long long)((dtask->src_block_max << shift) +
+										 dtask->start_sect),
+					dtask->nr_dma_submit,
+					dtask->nr_dma_blocks);
+		}
+		rcu_read_unlock();
+	}
+	if (deadline > 0 && nr_running > 0)
+		schedule_delayed_work(&strom_dma_task_watchdog_work, HZ);
+}
+
+static inline void
+strom_kick_dma_task_watchdog(void)
+{
+	if (dma_task_deadline > 0 &&
+		!delayed_work_pending(&strom_dma_task_watchdog_work))
+		schedule_delayed_work(&strom_dma_task_watchdog_work, HZ);
+}
+
+/*
+ * strom_create_dma_task
+ */
+static strom_dma_task *
+strom_create_dma_task(unsigned long handle,
+					  int fdesc,
+					  struct file *ioctl_filp)
+{
+	strom_dma_task		   *dtask;
+	long					retval;
+	unsigned long			flags;
+
+	/* allocate strom_dma_task object */
+	dtask = strom_mempool_alloc(&strom_dma_task_mempool);
+	if (!dtask)
+		return ERR_PTR(-ENOMEM);
+	retval = strom_init_dma_task(dtask, handle, fdesc);
+	if (retval)
+	{
+		strom_mempool_free(&strom_dma_task_mempool, dtask);
+		return ERR_PTR(retval);
+	}
+	dtask->dma_task_id	= atomic64_inc_return(&strom_dma_task_seq);
+	dtask->hindex		= strom_dma_task_index(dtask->dma_task_id);
+	dtask->ioctl_filp	= get_file(ioctl_filp);
+	dtask->fcontext		= ioctl_filp->private_data;
+	dtask->file_pages	= strom_mempool_alloc(&strom_file_pages_mempool);
+
+	/* OK, this strom_dma_task is now tracked */
+	spin_lock_irqsave(&strom_dma_task_locks[dtask->hindex], flags);
+	list_add_rcu(&dtask->chain, &strom_dma_task_slots[dtask->hindex]);
+	spin_unlock_irqrestore(&strom_dma_task_locks[dtask->hindex], flags);
+	strom_kick_dma_task_watchdog();
+
+	return dtask;
 }
 
 /*
@@ -793,6 +2219,176 @@ strom_get_dma_task(strom_dma_task *dtask)
 	return dtask;
 }
 
+/*
+ * strom_dma_task_is_running
+ */
+static bool
+strom_dma_task_is_running(unsigned long dma_task_id)
+{
+	int					hindex = strom_dma_task_index(dma_task_id);
+	struct list_head   *slot = &strom_dma_task_slots[hindex];
+	strom_dma_task	   *dtask;
+	bool				task_is_running = false;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(dtask, slot, chain)
+	{
+		if (dtask->dma_task_id == dma_task_id)
+		{
+			task_is_running = true;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return task_is_running;
+}
+
+/*
+ * strom_check_dma_task - checks status of the DMA task
+ *
+ * It returns true if DMA task is still running. Elsewhere, it returns false
+ * and set status of the DMA task on @p_dma_status. Error status kept on the
+ * failed_dma_task_slots is reclaimed here, only if the DMA task was issued
+ * on @fcontext. dma_task_id is sequential and easy to guess, so the others
+ * shall not steal the error status; they see no status instead.
+ */
+static bool
+strom_check_dma_task(unsigned long dma_task_id,
+					 strom_file_context *fcontext,
+					 long *p_dma_status)
+{
+	int					hindex = strom_dma_task_index(dma_task_id);
+	spinlock_t		   *lock = &strom_dma_task_locks[hindex];
+	struct list_head   *slot = &failed_dma_task_slots[hindex];
+	strom_dma_task	   *dtask;
+	strom_dma_task	   *dfailed = NULL;
+	unsigned long		flags;
+
+	if (strom_dma_task_is_running(dma_task_id))
+		return true;
+
+	/* not running, so check error status */
+	*p_dma_status = 0;
+	spin_lock_irqsave(lock, flags);
+	list_for_each_entry(dtask, slot, failed_chain)
+	{
+		if (dtask->dma_task_id == dma_task_id)
+		{
+			/* only DMA tasks issued on the same file handler */
+			if (dtask->fcontext != fcontext)
+				break;
+			*p_dma_status = dtask->dma_status;
+			list_del(&dtask->failed_chain);
+			spin_lock(&fcontext->lock);
+			list_del(&dtask->fcontext_chain);
+			fcontext->nr_failed--;
+			spin_unlock(&fcontext->lock);
+			dfailed = dtask;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(lock, flags);
+
+	if (dfailed)
+		strom_free_dma_task(dfailed);
+	return false;
+}
+
+/*
+ * strom_cancel_dma_task
+ *
+ * It marks the running DMA task as cancelled. The requests not submitted
+ * yet are dropped, then the DMA task gets completed with -ECANCELED once
+ * the commands already in the NVMe queue are done.
+ */
+static int
+strom_cancel_dma_task(unsigned long dma_task_id, struct file *ioctl_filp)
+{
+	int					hindex = strom_dma_task_index(dma_task_id);
+	spinlock_t		   *lock = &strom_dma_task_locks[hindex];
+	struct list_head   *slot = &strom_dma_task_slots[hindex];
+	strom_dma_task	   *dtask;
+	unsigned long		flags;
+	int					retval = -ENOENT;
+
+	spin_lock_irqsave(lock, flags);
+	list_for_each_entry(dtask, slot, chain)
+	{
+		if (dtask->dma_task_id == dma_task_id)
+		{
+			/* only DMA tasks issued on the same file handler */
+			if (dtask->fcontext != ioctl_filp->private_data)
+				retval = -EPERM;
+			else
+			{
+				if (!dtask->dma_status)
+					dtask->dma_status = -ECANCELED;
+				ACCESS_ONCE(dtask->cancelled) = true;
+				retval = 0;
+			}
+			break;
+		}
+	}
+	spin_unlock_irqrestore(lock, flags);
+
+	return retval;
+}
+
+/*
+ * NOTE: Error status of the failed DMA tasks are kept until application
+ * waits for the task or closes the file handler. It is bounded by the
+ * max_failed_tasks per file handler; the oldest one is dropped.
+ */
+static int	max_failed_tasks = 256;
+module_param(max_failed_tasks, int, 0644);
+MODULE_PARM_DESC(max_failed_tasks,
+				 "max number of the failed DMA tasks per file handler to be "
+				 "retained until wait");
+
+static atomic64_t	strom_nr_dropped_errors = ATOMIC64_INIT(0);
+
+/*
+ * strom_reclaim_failed_tasks
+ *
+ * It reclaims the oldest failed DMA tasks of the file handler, until its
+ * number gets @nr_keep or less. It has to be called without locks.
+ */
+static void
+strom_reclaim_failed_tasks(strom_file_context *fcontext, int nr_keep,
+						   bool is_release)
+{
+	strom_dma_task *dtask;
+	unsigned long	dma_task_id;
+	unsigned long	flags;
+	long			dma_status;
+
+	for (;;)
+	{
+		spin_lock_irqsave(&fcontext->lock, flags);
+		if (fcontext->nr_failed <= nr_keep)
+		{
+			spin_unlock_irqrestore(&fcontext->lock, flags);
+			break;
+		}
+		dtask = list_first_entry(&fcontext->failed_tasks,
+								 strom_dma_task, fcontext_chain);
+		dma_task_id = dtask->dma_task_id;
+		spin_unlock_irqrestore(&fcontext->lock, flags);
+
+		/* someone might reclaim the task concurrently */
+		if (strom_check_dma_task(dma_task_id, fcontext, &dma_status) ||
+			!dma_status)
+			continue;
+		if (is_release)
+			prNotice("Unreferenced asynchronous SSD2GPU DMA error "
+					 "(dma_task_id: %lu, status=%ld)",
+					 dma_task_id, dma_status);
+		else
+			atomic64_inc(&strom_nr_dropped_errors);
+	}
+}
+
 /*
  * strom_put_dma_task
  */
@@ -803,6 +2399,25 @@ strom_put_dma_task(strom_dma_task *dtask, long dma_status)
 	unsigned long		flags = 0;
 	bool				has_spinlock = false;
 
+	/* untracked DMA task of the synchronous fast path */
+	if (dtask->untracked)
+	{
+		int		refcnt_new;
+
+		if (unlikely(dma_status))
+			cmpxchg(&dtask->dma_status, 0, dma_status);
+		refcnt_new = atomic_dec_return(&dtask->refcnt);
+		if (refcnt_new == 1)
+			complete(&dtask->sync_done);	/* only the waiter remains */
+		else if (refcnt_new == 0)
+		{
+			strom_put_mapped_gpu_memory(dtask->mgmem);
+			fput(dtask->filp);
+			strom_mempool_free(&strom_dma_task_mempool, dtask);
+		}
+		return;
+	}
+
 	if (unlikely(dma_status))
 	{
 		spin_lock_irqsave(&strom_dma_task_locks[hindex], flags);
@@ -815,7 +2430,11 @@ strom_put_dma_task(strom_dma_task *dtask, long dma_status)
 	{
 		mapped_gpu_memory *mgmem = dtask->mgmem;
 		struct file	   *ioctl_filp = dtask->ioctl_filp;
+		strom_file_context *fcontext = dtask->fcontext;
+		bool			needs_reclaim = false;
 		struct file	   *data_filp = dtask->filp;
+		unsigned long	dma_task_id = dtask->dma_task_id;
+		size_t			nr_bytes = dtask->nr_bytes;
 		long			dma_status;
 
 		if (!has_spinlock)
@@ -833,40 +2452,195 @@ strom_put_dma_task(strom_dma_task *dtask, long dma_status)
 			dtask->filp = NULL;
 			dtask->mgmem = NULL;
 
-			list_add_tail_rcu(&dtask->chain, &failed_dma_task_slots[hindex]);
+			list_add_tail(&dtask->failed_chain,
+						  &failed_dma_task_slots[hindex]);
+			spin_lock(&fcontext->lock);
+			list_add_tail(&dtask->fcontext_chain, &fcontext->failed_tasks);
+			if (++fcontext->nr_failed > max_failed_tasks)
+				needs_reclaim = true;
+			spin_unlock(&fcontext->lock);
 		}
 		spin_unlock_irqrestore(&strom_dma_task_locks[hindex], flags);
 		/* wake up all the waiting tasks, if any */
-		wake_up_all(&strom_dma_task_waitq[hindex]);
+		__wake_up(&strom_dma_task_waitq[hindex], TASK_NORMAL, 0,
+				  (void *)dma_task_id);
+		/* notify the completion to the ioctl_filp, if required */
+		strom_notify_completion(ioctl_filp, dma_task_id,
+								dma_status, nr_bytes);
+		/* drop the oldest error status, if too many */
+		if (unlikely(needs_reclaim))
+			strom_reclaim_failed_tasks(fcontext, Max(max_failed_tasks, 0),
+									   false);
 
 		/* release the dtask object, if no error */
 		if (likely(!dma_status))
-			kfree(dtask);
+			strom_free_dma_task(dtask);
 		strom_put_mapped_gpu_memory(mgmem);
 		fput(data_filp);
 		fput(ioctl_filp);
 
-		prDebug("DMA task (id=%p) was completed", dtask);
+		prDebug("DMA task (id=%lu) was completed", dma_task_id);
 	}
 	else if (has_spinlock)
 		spin_unlock_irqrestore(&strom_dma_task_locks[hindex], flags);
 }
 
+/*
+ * ================================================================
+ *
+ * Cost model to choose the data transfer path
+ *
+ * ================================================================
+ */
+
+/*
+ * NOTE: A block of the source file is transferred by one of the paths below.
+ *
+ * SSD2GPU   : P2P DMA from NVMe-SSD to GPU
+ * RAM2GPU   : CPU copy from the page cache to GPU
+ * WRITEBACK : CPU copy from the page cache to the host buffer
+ *             (only STROM_IOCTL__MEMCPY_SSD2GPU_WRITEBACK)
+ * HOSTREAD  : buffered read of the uncached page to the host buffer
+ *             (only STROM_IOCTL__MEMCPY_SSD2GPU_WRITEBACK)
+ *
+ * Cost of each path is elapsed time to transfer a page, estimated by the
+ * moving average of the actual timings on completion. Initial estimation
+ * follows the former fixed policy; RAM2GPU for the cached pages on
+ * the SSD2GPU memcpy, and write-back for the mostly cached chunks.
+ */
+#define STROM_PATH__SSD2GPU			0
+#define STROM_PATH__RAM2GPU			1
+#define STROM_PATH__WRITEBACK		2
+#define STROM_PATH__HOSTREAD		3
+#define STROM_PATH__NUMS			4
+
+static const char *strom_path_names[STROM_PATH__NUMS] = {
+	"ssd2gpu",
+	"ram2gpu",
+	"writeback",
+	"hostread",
+};
+/* cost of the paths, in nanoseconds per page */
+static unsigned long strom_path_cost[STROM_PATH__NUMS] = {
+	1600,		/* SSD2GPU; 2.5GB/s */
+	1000,		/* RAM2GPU; 4.0GB/s */
+	400,		/* WRITEBACK; 10GB/s */
+	4000,		/* HOSTREAD; 1.0GB/s */
+};
+#define STROM_PATH_COST_SHIFT		3	/* weight of the new sample = 1/8 */
+
+/*
+ * NOTE: The planner decides the path per chunk, not per page, so pages of
+ * a chunk are still merged into large requests. Every @planner_probe_interval
+ * decisions on a CPU, it tries the path more expensive as of now instead.
+ */
+static int	planner_probe_interval = 64;
+module_param(planner_probe_interval, int, 0644);
+MODULE_PARM_DESC(planner_probe_interval,
+				 "interval of the decisions to try the more expensive path, "
+				 "to keep its cost up to date (default: 64, 0 = never)");
+static DEFINE_PER_CPU(unsigned int, strom_planner_count);
+
+/*
+ * strom_update_path_cost - merge a timing sample of the path
+ *
+ * Concurrent updates may lose a sample, but it is harmless for estimation.
+ * Caller gives the length multiplied by the number of concurrent requests
+ * of the same path, because they share the device (or CPUs) and the elapsed
+ * time of each one includes the others.
+ */
+static void
+strom_update_path_cost(int path, u64 elapsed_ns, size_t length)
+{
+	unsigned long	sample;
+	unsigned long	cost;
+
+	if (length == 0)
+		return;
+	sample = div64_u64(elapsed_ns << PAGE_CACHE_SHIFT, length);
+	cost = ACCESS_ONCE(strom_path_cost[path]);
+	cost = cost - (cost >> STROM_PATH_COST_SHIFT)
+		+ (sample >> STROM_PATH_COST_SHIFT);
+	ACCESS_ONCE(strom_path_cost[path]) = Max(cost, 1UL);
+}
+
+/*
+ * strom_planner_probe - true, if this decision should try the path that is
+ * more expensive as of now. Unless the path is chosen sometimes, its cost
+ * will never be updated.
+ */
+static bool
+strom_planner_probe(void)
+{
+	int		interval = ACCESS_ONCE(planner_probe_interval);
+
+	return (interval > 0 &&
+			this_cpu_inc_return(strom_planner_count) %
+			(unsigned int)interval == 0);
+}
+
+/*
+ * strom_page_is_stale_on_ssd - true, if the storage may not have the latest
+ * contents of the page cache, thus, it must be copied by CPU.
+ */
+static inline bool
+strom_page_is_stale_on_ssd(struct page *fpage)
+{
+	return (PageDirty(fpage) || PageWriteback(fpage));
+}
+
+/*
+ * strom_plan_writeback_chunk - true, if the chunk shall be written back to
+ * the host buffer. Elsewhere, it shall be sent to GPU by SSD2GPU DMA, and
+ * its stale pages on the storage are copied by RAM2GPU.
+ */
+static bool
+strom_plan_writeback_chunk(unsigned int n_pages,
+						   unsigned int n_cached,
+						   unsigned int n_stale)
+{
+	u64		cost_gpu;
+	u64		cost_host;
+	bool	use_writeback;
+
+	cost_gpu = ((u64)n_stale *
+				ACCESS_ONCE(strom_path_cost[STROM_PATH__RAM2GPU]) +
+				(u64)(n_pages - n_stale) *
+				ACCESS_ONCE(strom_path_cost[STROM_PATH__SSD2GPU]));
+	cost_host = ((u64)n_cached *
+				 ACCESS_ONCE(strom_path_cost[STROM_PATH__WRITEBACK]) +
+				 (u64)(n_pages - n_cached) *
+				 ACCESS_ONCE(strom_path_cost[STROM_PATH__HOSTREAD]));
+	use_writeback = (cost_host < cost_gpu);
+	if (strom_planner_probe())
+		use_writeback = !use_writeback;
+	return use_writeback;
+}
+
 /*
  * submit_ram2gpu_memcpy - asynchronous RAM2GPU copy by CPU workqueue
+ *
+ * A RAM2GPU job copies up to STROM_RAM2GPU_FPU_NPAGES pages in a single FPU
+ * section, instead of kernel_fpu_begin/end per page.
  */
+#define STROM_RAM2GPU_FPU_NPAGES		16
+
+static atomic_t	strom_ram2gpu_nr_active = ATOMIC_INIT(0);
+
 static void
 callback_ram2gpu_memcpy(struct work_struct *work)
 {
 	strom_memcpy_task  *mc_task = (strom_memcpy_task *) work;
 	strom_dma_task	   *dtask = mc_task->dtask;
 	mapped_gpu_memory  *mgmem = dtask->mgmem;
-	nvidia_p2p_page_table_t *page_table = mgmem->page_table;
 	size_t		dest_offset = mc_task->offset;
-	char	   *dest_iomap = NULL;
-	int			dest_index = -1;
+	char __iomem *dest_iomap;
 	size_t		cur = mc_task->page_ofs;
 	size_t		end = mc_task->page_ofs + mc_task->copy_len;
+	u64			start_ns = ktime_to_ns(ktime_get());
+	int			nr_active;
+	bool		use_simd = false;
+	int			nr_batch = 0;
 	int			i, j;
 	long		status = 0;
 
@@ -874,32 +2648,38 @@ callback_ram2gpu_memcpy(struct work_struct *work)
 			mc_task->copy_len +
 			PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT == mc_task->nr_fpages);
 
-	while (cur < end)
+	/* no need to copy, if DMA task is already cancelled */
+	if (unlikely(ACCESS_ONCE(dtask->cancelled)))
+		status = -ECANCELED;
+	/* jobs running concurrently share the CPU-to-GPU bandwidth */
+	nr_active = atomic_inc_return(&strom_ram2gpu_nr_active);
+
+	while (status == 0 && cur < end)
 	{
 		struct page	   *fpage = mc_task->file_pages[cur >> PAGE_CACHE_SHIFT];
 		size_t			page_ofs = (cur & (PAGE_CACHE_SIZE - 1));
 		size_t			page_len;
-		uint64_t		phy_addr;
 		char		   *saddr;
-		char		   *daddr;
+		char __iomem   *daddr;
 
 		/* length to copy from this page */
 		page_len = Min(PAGE_CACHE_SIZE, end - (cur & PAGE_MASK)) - page_ofs;
 
 		/* map destination GPU page using write-combined mode */
 		j = dest_offset >> mgmem->gpu_page_shift;
-		if (!dest_iomap || j != dest_index)
+		dest_iomap = ACCESS_ONCE(mgmem->iomap_cache[j]);
+		if (!dest_iomap)
 		{
-			if (dest_iomap)
-				iounmap(dest_iomap);
-			phy_addr = page_table->pages[j]->physical_address;
-			dest_iomap = ioremap_wc(phy_addr, mgmem->gpu_page_sz);
+			/* ioremap_wc() may sleep, so leave the FPU section first */
+			strom_memcpy_toio_end(use_simd);
+			use_simd = false;
+			nr_batch = 0;
+			dest_iomap = strom_get_gpu_page_iomap(mgmem, j);
 			if (!dest_iomap)
 			{
 				status = -ENOMEM;
 				break;
 			}
-			dest_index = j;
 		}
 		/* choose shorter page_len if it comes across GPU page boundary */
 		if (j != ((dest_offset + page_len) >> mgmem->gpu_page_shift))
@@ -909,64 +2689,199 @@ callback_ram2gpu_memcpy(struct work_struct *work)
 		}
 		/* do copy by CPU */
 		daddr = dest_iomap + (dest_offset & (mgmem->gpu_page_sz - 1));
+		if (nr_batch == 0)
+			use_simd = strom_memcpy_toio_begin();
 		saddr = kmap_atomic(fpage);
-
-		memcpy_toio(daddr, saddr + page_ofs, page_len);
+		strom_memcpy_toio(daddr, saddr + page_ofs, page_len, use_simd);
 		kunmap_atomic(saddr);
+		/* bound the latency of the non-preemptible FPU section */
+		if (++nr_batch == STROM_RAM2GPU_FPU_NPAGES)
+		{
+			strom_memcpy_toio_end(use_simd);
+			use_simd = false;
+			nr_batch = 0;
+		}
 
 		cur += page_len;
 		dest_offset += page_len;
 	}
+	strom_memcpy_toio_end(use_simd);
+	atomic_dec(&strom_ram2gpu_nr_active);
 	Assert(cur == end || status != 0);
+	if (status == 0)
+		strom_update_path_cost(STROM_PATH__RAM2GPU,
+							   ktime_to_ns(ktime_get()) - start_ns,
+							   mc_task->copy_len * nr_active);
 	/* release resources */
 	for (i=0; i < mc_task->nr_fpages; i++)
 	{
 		unlock_page(mc_task->file_pages[i]);
 		page_cache_release(mc_task->file_pages[i]);
 	}
-	if (dest_iomap)
-		iounmap(dest_iomap);
 
 	strom_put_dma_task(dtask, status);
-	kfree(mc_task);
+	strom_mempool_free(strom_memcpy_task_pool(mc_task->nr_fpages), mc_task);
+}
+
+/*
+ * RAM2GPU memcpy jobs are queued to the dedicated unbound workqueue, not to
+ * the system workqueue, because copy of 2MB by CPU is long enough to block
+ * the other kernel works. Its concurrency is bounded by @ram2gpu_max_active.
+ */
+static int	ram2gpu_max_active = 0;
+module_param(ram2gpu_max_active, int, 0444);
+MODULE_PARM_DESC(ram2gpu_max_active,
+				 "max number of concurrent RAM2GPU memcpy jobs "
+				 "(default: 0 = number of online CPUs)");
+
+static int	ram2gpu_numa_node = -1;
+module_param(ram2gpu_numa_node, int, 0644);
+MODULE_PARM_DESC(ram2gpu_numa_node,
+				 "NUMA node to run RAM2GPU memcpy jobs "
+				 "(default: -1 = node of the NVMe device)");
+
+static struct workqueue_struct *strom_ram2gpu_wq = NULL;
+
+/*
+ * strom_choose_ram2gpu_cpu - it returns a CPU whose NUMA node is preferable
+ * to run the RAM2GPU memcpy job, or WORK_CPU_UNBOUND if no preference.
+ *
+ * GPU device is not visible to us, but P2P DMA works only when SSD and GPU
+ * are under the same PCIe root complex, so NUMA node of the NVMe device is
+ * usually identical to the one of GPU device.
+ */
+static int
+strom_choose_ram2gpu_cpu(strom_dma_task *dtask)
+{
+	int		node = ACCESS_ONCE(ram2gpu_numa_node);
+	int		cpu;
+
+	if (node < 0 || node >= nr_node_ids || !node_online(node))
+		node = dev_to_node(&dtask->nvme_ns->dev->pci_dev->dev);
+	if (node == NUMA_NO_NODE)
+		return WORK_CPU_UNBOUND;
+	cpu = cpumask_any_and(cpumask_of_node(node), cpu_online_mask);
+	if (cpu >= nr_cpu_ids)
+		return WORK_CPU_UNBOUND;
+	return cpu;
 }
 
+/*
+ * A large RAM2GPU batch is split into multiple memcpy jobs, to run them
+ * on multiple workers concurrently. Each job covers about @ram2gpu_split_size
+ * bytes (or the GPU page size, if 0) of the source pages. Jobs are split on
+ * the page boundary of the source, because a page cache is locked by only
+ * one job.
+ */
+static int	ram2gpu_split_size = 0;
+module_param(ram2gpu_split_size, int, 0644);
+MODULE_PARM_DESC(ram2gpu_split_size,
+				 "length of the RAM2GPU memcpy job "
+				 "(default: 0 = GPU page size, -1 = no split)");
+
 static int
 submit_ram2gpu_memcpy(strom_dma_task *dtask)
 {
 	strom_memcpy_task  *mc_task;
-	int		i;
+	int			split_size = ACCESS_ONCE(ram2gpu_split_size);
+	int			cpu = strom_choose_ram2gpu_cpu(dtask);
+	size_t		cur = dtask->page_ofs;
+	size_t		end = dtask->page_ofs + dtask->copy_len;
+	size_t		dest_offset = dtask->dest_offset;
+	unsigned int split_npages;
+	unsigned int i, j;
+	int			retval = 0;
+
+	Assert(dtask->nr_fpages <= STROM_RAM2GPU_MAXPAGES);
+	Assert((end + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT == dtask->nr_fpages);
+	if (split_size < 0)
+		split_npages = STROM_RAM2GPU_MAXPAGES;
+	else
+	{
+		if (split_size == 0)
+			split_size = dtask->mgmem->gpu_page_sz;
+		split_npages = Max(split_size >> PAGE_CACHE_SHIFT, 1);
+	}
 
-	mc_task = kmalloc(offsetof(strom_memcpy_task,
-							   file_pages[dtask->nr_fpages]),
-					  GFP_KERNEL);
-	if (!mc_task)
+	for (i=0; i < dtask->nr_fpages; i += j)
 	{
-		for (i=0; i < dtask->nr_fpages; i++)
-		{
-			struct page	   *fpage = dtask->file_pages[i];
+		size_t		copy_len;
 
-			unlock_page(fpage);
-			page_cache_release(fpage);
-		}
-		return -ENOMEM;
-	}
+		j = Min(dtask->nr_fpages - i, split_npages);
+		copy_len = Min(end, (size_t)(i + j) << PAGE_CACHE_SHIFT) - cur;
 
-	INIT_WORK(&mc_task->work, callback_ram2gpu_memcpy);
-	mc_task->dtask		= strom_get_dma_task(dtask);
-	mc_task->offset		= dtask->dest_offset;
-	mc_task->copy_len	= dtask->copy_len;
-	mc_task->page_ofs	= dtask->page_ofs;
-	mc_task->nr_fpages	= dtask->nr_fpages;
-	memcpy(mc_task->file_pages, dtask->file_pages,
-		   sizeof(struct page *) * dtask->nr_fpages);
-	schedule_work(&mc_task->work);
+		mc_task = NULL;
+		if (unlikely(ACCESS_ONCE(dtask->cancelled)))
+			retval = -ECANCELED;
+		else if (!(mc_task = strom_mempool_alloc(strom_memcpy_task_pool(j))))
+			retval = -ENOMEM;
+		if (!mc_task)
+			break;
+
+		INIT_WORK(&mc_task->work, callback_ram2gpu_memcpy);
+		mc_task->dtask		= strom_get_dma_task(dtask);
+		mc_task->offset		= dest_offset;
+		mc_task->copy_len	= copy_len;
+		mc_task->page_ofs	= (cur & (PAGE_CACHE_SIZE - 1));
+		mc_task->nr_fpages	= j;
+		memcpy(mc_task->file_pages, dtask->file_pages + i,
+			   sizeof(struct page *) * j);
+		dtask->no_polling = true;
+		queue_work_on(cpu, strom_ram2gpu_wq, &mc_task->work);
+
+		cur += copy_len;
+		dest_offset += copy_len;
+	}
+	/* release the pages not handed to the jobs, if any errors */
+	for (; i < dtask->nr_fpages; i++)
+	{
+		struct page	   *fpage = dtask->file_pages[i];
 
+		unlock_page(fpage);
+		page_cache_release(fpage);
+	}
 	dtask->nr_fpages	= 0;	/* reset */
 
-	return 0;
+	return retval;
 }
 
+/*
+ * NOTE: blk-mq maps a request to the hardware queue associated with the
+ * CPU that allocates the request, so SSD2GPU DMA requests are usually
+ * submitted to the hardware queue local to the caller. Once the local
+ * queue has many in-flight requests of NVMe-Strom, the following requests
+ * are dispatched to the other CPUs in round-robin, to keep multiple
+ * hardware queues busy by a small number of scanning processes.
+ * In-flight requests are counted per CPU that allocated the request;
+ * it is identical to per hardware queue if they are mapped 1:1.
+ */
+static int	hwq_spread_threshold = 16;
+module_param(hwq_spread_threshold, int, 0644);
+MODULE_PARM_DESC(hwq_spread_threshold,
+				 "# of in-flight requests per CPU to spread DMA requests "
+				 "across hardware queues (0 = never)");
+
+static DEFINE_PER_CPU(atomic_t, strom_hwq_inflight);
+
+/*
+ * Number of SSD2GPU DMA requests to be staged on the submission queue
+ * prior to ring the doorbell.
+ */
+static int	doorbell_batch = 16;
+module_param(doorbell_batch, int, 0644);
+MODULE_PARM_DESC(doorbell_batch,
+				 "# of DMA requests per doorbell write (1 = no batching)");
+
+/*
+ * NOTE: NVMe-SSD which supports SGL (Scatter Gather List) can describe
+ * a physically contiguous GPU page by a descriptor, instead of PRP entry
+ * per host page. RHEL7 kernel does not keep SGL support of the controller
+ * (SGLS field of the identify data), so it has to be turned on manually.
+ */
+static int	use_sgl = 0;
+module_param(use_sgl, int, 0644);
+MODULE_PARM_DESC(use_sgl, "use SGL for SSD2GPU DMA, if NVMe-SSD supports");
+
 /*
  * DMA transaction for SSD->GPU asynchronous copy
  */
@@ -976,6 +2891,204 @@ submit_ram2gpu_memcpy(strom_dma_task *dtask)
 #error "no platform specific NVMe-SSD routines"
 #endif
 
+/*
+ * strom_ssd2gpu_dispatch - requests of SSD2GPU DMA submission on other CPU
+ *
+ * Requests to be spilled to the same CPU are batched, to save the cost of
+ * allocation and workqueue switch per request.
+ */
+#define STROM_DISPATCH_MAXCMDS		16
+
+struct strom_ssd2gpu_dispatch
+{
+	struct work_struct work;
+	strom_dma_task	   *dtask;
+	int					cpu;		/* CPU to submit the requests */
+	int					nr_cmds;	/* number of the requests */
+	struct {
+		struct nvme_iod *iod;		/* NULL, if PRP table is used */
+		u64				prp1;
+		u64				prp2;
+		sector_t		src_block;
+		unsigned int	nr_blocks;
+	} cmds[STROM_DISPATCH_MAXCMDS];
+};
+typedef struct strom_ssd2gpu_dispatch	strom_ssd2gpu_dispatch;
+
+static void
+callback_ssd2gpu_dispatch(struct work_struct *work)
+{
+	strom_ssd2gpu_dispatch *dispatch = (strom_ssd2gpu_dispatch *) work;
+	strom_dma_task	   *dtask = dispatch->dtask;
+	int					i, retval;
+
+	/* each request holds a reference of the DMA task */
+	for (i=0; i < dispatch->nr_cmds; i++)
+	{
+		if (unlikely(ACCESS_ONCE(dtask->cancelled)))
+			retval = -ECANCELED;
+		else
+			retval = nvme_submit_async_read_cmd(dtask,
+												dispatch->cmds[i].iod,
+												dispatch->cmds[i].prp1,
+												dispatch->cmds[i].prp2,
+												dispatch->cmds[i].src_block,
+												dispatch->cmds[i].nr_blocks,
+												false);
+		if (retval)
+		{
+			prDebug("nvme_submit_async_read_cmd() = %d", retval);
+			if (dispatch->cmds[i].iod)
+				__nvme_free_iod(dtask->nvme_ns->dev, dispatch->cmds[i].iod);
+			strom_put_dma_task(dtask, retval);
+		}
+	}
+	kfree(dispatch);
+}
+
+/*
+ * strom_flush_dispatch - kicks the pending requests to the other CPU
+ */
+static void
+strom_flush_dispatch(strom_dma_task *dtask)
+{
+	strom_ssd2gpu_dispatch *dispatch = dtask->dispatch;
+
+	if (!dispatch)
+		return;
+	dtask->dispatch = NULL;
+	queue_work_on(dispatch->cpu, system_wq, &dispatch->work);
+}
+
+/*
+ * strom_flush_submission - notifies all the pending requests of the DMA task
+ * to the controller or to the other CPUs. The submitter has to call it prior
+ * to any blocking operations, because the staged requests already hold tags
+ * and their timers are running.
+ */
+static void
+strom_flush_submission(strom_dma_task *dtask)
+{
+	nvme_ring_doorbell(dtask);
+	strom_flush_dispatch(dtask);
+}
+
+/*
+ * strom_choose_submit_cpu - it returns a CPU to submit the next request of
+ * the DMA task, or -1 if local CPU is preferable. The last CPU is kept as
+ * long as it is not busy, to batch the dispatched requests.
+ */
+static int
+strom_choose_submit_cpu(strom_dma_task *dtask)
+{
+	struct request_queue *q = dtask->nvme_ns->queue;
+	int		cpu_local;
+	int		cpu = dtask->submit_cpu;
+	int		i;
+
+	if (hwq_spread_threshold <= 0 || !q->mq_map || q->nr_hw_queues < 2)
+		return -1;
+
+	cpu_local = get_cpu();
+	if (atomic_read(&per_cpu(strom_hwq_inflight,
+							 cpu_local)) < hwq_spread_threshold)
+	{
+		put_cpu();
+		return -1;
+	}
+
+	if (dtask->dispatch &&
+		atomic_read(&per_cpu(strom_hwq_inflight,
+							 cpu)) < hwq_spread_threshold)
+	{
+		put_cpu();
+		return cpu;
+	}
+
+	for (i=0; i < nr_cpu_ids; i++)
+	{
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+		if (q->mq_map[cpu] == q->mq_map[cpu_local])
+			continue;
+		if (atomic_read(&per_cpu(strom_hwq_inflight,
+								 cpu)) < hwq_spread_threshold)
+		{
+			put_cpu();
+			dtask->submit_cpu = cpu;
+			return cpu;
+		}
+	}
+	put_cpu();
+
+	return -1;	/* all the queues are busy, so local one is best */
+}
+
+/*
+ * strom_dispatch_async_read_cmd - it submits the pending request of the DMA
+ * task on the local CPU, or dispatches it to the other CPU.
+ * If @iod is NULL, @prp1 and @prp2 are used as is.
+ */
+static int
+strom_dispatch_async_read_cmd(strom_dma_task *dtask, struct nvme_iod *iod,
+							  u64 prp1, u64 prp2)
+{
+	strom_ssd2gpu_dispatch *dispatch;
+	int		cpu = strom_choose_submit_cpu(dtask);
+	int		i, retval;
+
+	strom_get_dma_task(dtask);
+	if (cpu < 0)
+	{
+		retval = nvme_submit_async_read_cmd(dtask, iod, prp1, prp2,
+											dtask->src_block,
+											dtask->nr_blocks,
+											true);
+		if (retval)
+			strom_put_dma_task(dtask, 0);
+		return retval;
+	}
+
+	dispatch = dtask->dispatch;
+	if (dispatch && dispatch->cpu != cpu)
+	{
+		strom_flush_dispatch(dtask);
+		dispatch = NULL;
+	}
+	if (!dispatch)
+	{
+		dispatch = kmalloc(sizeof(strom_ssd2gpu_dispatch), GFP_NOWAIT);
+		if (!dispatch)
+		{
+			nvme_ring_doorbell(dtask);
+			dispatch = kmalloc(sizeof(strom_ssd2gpu_dispatch), GFP_KERNEL);
+		}
+		if (!dispatch)
+		{
+			strom_put_dma_task(dtask, 0);
+			return -ENOMEM;
+		}
+		INIT_WORK(&dispatch->work, callback_ssd2gpu_dispatch);
+		dispatch->dtask		= dtask;
+		dispatch->cpu		= cpu;
+		dispatch->nr_cmds	= 0;
+		dtask->dispatch		= dispatch;
+	}
+	/* completion of the request on the other CPU is not polled */
+	dtask->no_polling = true;
+	i = dispatch->nr_cmds++;
+	dispatch->cmds[i].iod		= iod;
+	dispatch->cmds[i].prp1		= prp1;
+	dispatch->cmds[i].prp2		= prp2;
+	dispatch->cmds[i].src_block	= dtask->src_block;
+	dispatch->cmds[i].nr_blocks	= dtask->nr_blocks;
+	if (dispatch->nr_cmds == STROM_DISPATCH_MAXCMDS)
+		strom_flush_dispatch(dtask);
+
+	return 0;
+}
+
 /* alternative of the core nvme_alloc_iod */
 static struct nvme_iod *
 nvme_alloc_iod(size_t nbytes,
@@ -1023,18 +3136,42 @@ submit_ssd2gpu_memcpy(strom_dma_task *dtask)
 	size_t				offset;
 	size_t				total_nbytes;
 	dma_addr_t			base_addr;
+	u64					prp1, prp2;
 	int					length;
 	int					i, base;
 	int					retval;
 
+	/* drop the pending request, if DMA task is cancelled */
+	if (unlikely(ACCESS_ONCE(dtask->cancelled)))
+	{
+		retval = -ECANCELED;
+		goto out;
+	}
+
 	total_nbytes = (dtask->nr_blocks << dtask->blocksz_shift);
-	if (!total_nbytes || total_nbytes > STROM_DMA_SSD2GPU_MAXLEN)
+	if (!total_nbytes || dtask->nr_blocks > dtask->max_nblocks)
 		return -EINVAL;
 	if (dtask->dest_offset < mgmem->map_offset ||
 		dtask->dest_offset + total_nbytes > (mgmem->map_offset +
 											 mgmem->map_length))
 		return -ERANGE;
 
+	/*
+	 * No need to set up PRPs, if PRP table is available. It shall not
+	 * block for allocation if any requests are staged.
+	 */
+	if (!use_sgl &&
+		strom_lookup_prp_table(mgmem, nvme_dev,
+							   dtask->dest_offset, total_nbytes,
+							   &prp1, &prp2,
+							   dtask->db_nvmeq ? GFP_NOWAIT : GFP_KERNEL))
+	{
+		iod = NULL;
+		goto submit;
+	}
+
+	/* allocation of iod and PRP list may block */
+	strom_flush_submission(dtask);
 	iod = nvme_alloc_iod(total_nbytes,
 						 mgmem,
 						 nvme_dev,
@@ -1071,11 +3208,34 @@ submit_ssd2gpu_memcpy(strom_dma_task *dtask)
 	}
 	sg_mark_end(&iod->sg[i]);
 	iod->nents = i;
+	prp1 = prp2 = 0;
 
-	retval = nvme_submit_async_read_cmd(dtask, iod);
+submit:
+	retval = strom_dispatch_async_read_cmd(dtask, iod, prp1, prp2);
 	if (retval)
-		__nvme_free_iod(nvme_dev, iod);
+	{
+		if (iod)
+			__nvme_free_iod(nvme_dev, iod);
+	}
+	else
+	{
+		sector_t	src_block_last = dtask->src_block + dtask->nr_blocks - 1;
 
+		if (dtask->nr_dma_submit++ == 0)
+		{
+			dtask->src_block_min = dtask->src_block;
+			dtask->src_block_max = src_block_last;
+		}
+		else
+		{
+			dtask->src_block_min = Min(dtask->src_block_min,
+									   dtask->src_block);
+			dtask->src_block_max = Max(dtask->src_block_max,
+									   src_block_last);
+		}
+		dtask->nr_dma_blocks += dtask->nr_blocks;
+	}
+out:
 	/* clear the state */
 	dtask->nr_blocks = 0;
 	dtask->src_block = 0;
@@ -1084,86 +3244,367 @@ submit_ssd2gpu_memcpy(strom_dma_task *dtask)
 	return retval;
 }
 
+/*
+ * merge_ssd2gpu_memcpy - it merges the physically contiguous blocks with
+ * the pending SSD2GPU request as long as possible, and submits the pending
+ * request once it reaches to the upper limit or is not merginable.
+ */
+static int
+merge_ssd2gpu_memcpy(strom_dma_task *dtask,
+					 sector_t src_block,
+					 unsigned int nr_blocks,
+					 loff_t dest_offset)
+{
+	unsigned int	n;
+	int				retval;
+
+	while (nr_blocks > 0)
+	{
+		if (dtask->nr_blocks > 0 &&
+			dtask->nr_blocks < dtask->max_nblocks &&
+			dtask->src_block + dtask->nr_blocks == src_block &&
+			dtask->dest_offset + (dtask->nr_blocks
+								  << dtask->blocksz_shift) == dest_offset)
+		{
+			n = Min(nr_blocks, dtask->max_nblocks - dtask->nr_blocks);
+			dtask->nr_blocks += n;
+		}
+		else
+		{
+			/* Submit the latest pending blocks but not merginable */
+			if (dtask->nr_blocks > 0)
+			{
+				retval = submit_ssd2gpu_memcpy(dtask);
+				if (retval)
+				{
+					prDebug("submit_ssd2gpu_memcpy() = %d", retval);
+					return retval;
+				}
+				Assert(dtask->nr_blocks == 0);
+			}
+			/* These blocks become new head of the pending request */
+			n = Min(nr_blocks, dtask->max_nblocks);
+			dtask->src_block = src_block;
+			dtask->nr_blocks = n;
+			dtask->dest_offset = dest_offset;
+		}
+		src_block += n;
+		nr_blocks -= n;
+		dest_offset += (n << dtask->blocksz_shift);
+	}
+	return 0;
+}
+
+/*
+ * strom_freeze_dma_task - the submitter of the DMA task calls it at the
+ * end of submission. Any asynchronous job will not acquire the task any
+ * more, and resources only needed during submission are released.
+ */
+static void
+strom_freeze_dma_task(strom_dma_task *dtask)
+{
+	/* notify the staged or batched DMA requests */
+	strom_flush_submission(dtask);
+	/* release the staging buffer */
+	strom_mempool_free(&strom_file_pages_mempool, dtask->file_pages);
+	dtask->file_pages = NULL;
+	/* no async jobs will acquire the dtask any more */
+	dtask->frozen = true;
+	barrier();
+}
+
+/*
+ * NOTE: For small synchronous requests, interrupt and context switches
+ * dominate the latency. If sync_polling > 0, STROM_IOCTL__MEMCPY_SSD2GPU
+ * polls the completion queue where the requests were submitted, until
+ * completion of the DMA task or timeout in microseconds, prior to sleep.
+ * It is opportunistic reaping; the interrupt of the completion queue still
+ * fires, and whichever comes first processes the completion.
+ * It also enables the fast path for the small requests without the tracked
+ * DMA task; see memcpy_ssd2gpu_sync_small.
+ * Polling is skipped if any request of the DMA task was submitted to the
+ * other queues, dispatched to the other CPUs or handed to RAM2GPU jobs,
+ * because polling a single queue cannot complete such DMA task.
+ */
+static int	sync_polling = 0;
+module_param(sync_polling, int, 0644);
+MODULE_PARM_DESC(sync_polling,
+				 "max time in usec to poll completion of synchronous "
+				 "SSD2GPU DMA, with the fast path for small requests "
+				 "(0 = no polling)");
+
+/*
+ * strom_memcpy_ssd2gpu_poll - polls completion of a dma_task
+ *
+ * The DMA task is completed when its last reference is released, or
+ * @sync_done is completed for the untracked one. Caller must ensure @dtask
+ * is not released during the polling; by rcu_read_lock() prior to
+ * strom_put_dma_task() for the tracked DMA task, or by the reference of
+ * the waiter for the untracked one of the synchronous fast path.
+ */
+static void
+strom_memcpy_ssd2gpu_poll(strom_dma_task *dtask, struct nvme_queue *nvmeq)
+{
+	u64		timeout = local_clock() + (u64)sync_polling * NSEC_PER_USEC;
+
+	while (dtask->untracked
+		   ? !completion_done(&dtask->sync_done)
+		   : atomic_read(&dtask->refcnt) > 0)
+	{
+		if (!nvme_poll_queue(nvmeq))
+		{
+			if (local_clock() > timeout ||
+				need_resched() ||
+				signal_pending(current))
+				break;
+			cpu_relax();
+		}
+	}
+}
+
 /*
  * strom_memcpy_ssd2gpu_wait - synchronization of a dma_task
+ *
+ * It returns -ETIMEDOUT if DMA task is not completed within @timeout (in
+ * jiffies; MAX_SCHEDULE_TIMEOUT means infinite), but the DMA task is still
+ * reapable later.
  */
 static int
 strom_memcpy_ssd2gpu_wait(unsigned long dma_task_id,
+						  strom_file_context *fcontext,
 						  long *p_dma_task_status,
-						  int task_state)
+						  int task_state,
+						  long timeout)
 {
 	int					hindex = strom_dma_task_index(dma_task_id);
-	spinlock_t		   *lock = &strom_dma_task_locks[hindex];
 	wait_queue_head_t  *waitq = &strom_dma_task_waitq[hindex];
-	unsigned long		flags = 0;
-	strom_dma_task	   *dtask;
-	struct list_head   *slot;
+	strom_dma_task_waiter waiter;
+	long				dma_status;
 	int					retval = 0;
 
-	DEFINE_WAIT(__wait);
+	strom_init_dma_task_waiter(&waiter, dma_task_id);
 	for (;;)
 	{
-		bool	has_spinlock = false;
-		bool	task_is_running = false;
-
-		rcu_read_lock();
-	retry:
-		/* check error status first */
-		slot = &failed_dma_task_slots[hindex];
-		list_for_each_entry_rcu(dtask, slot, chain)
+		/* register to the waitqueue prior to the check not to lose wakeup */
+		prepare_to_wait(waitq, &waiter.wait, task_state);
+		if (!strom_check_dma_task(dma_task_id, fcontext, &dma_status))
 		{
-			if (dtask->dma_task_id == dma_task_id)
+			if (dma_status)
 			{
-				if (!has_spinlock)
-				{
-					rcu_read_unlock();
-					has_spinlock = true;
-					spin_lock_irqsave(lock, flags);
-					goto retry;
-				}
 				if (p_dma_task_status)
-					*p_dma_task_status = dtask->dma_status;
-				list_del(&dtask->chain);
-				spin_unlock_irqrestore(lock, flags);
-				kfree(dtask);
+					*p_dma_task_status = dma_status;
 				retval = -EIO;
-
-				goto out;
 			}
+			break;
 		}
+		if (signal_pending_state(task_state, current))
+		{
+			retval = -EINTR;
+			break;
+		}
+		if (timeout == 0)
+		{
+			retval = -ETIMEDOUT;
+			break;
+		}
+		/* wait for completion of DMA task */
+		timeout = schedule_timeout(timeout);
+	}
+	finish_wait(waitq, &waiter.wait);
 
-		/* check whether it is a running task or not */
-		slot = &strom_dma_task_slots[hindex];
-		list_for_each_entry_rcu(dtask, slot, chain)
+	return retval;
+}
+
+/*
+ * strom_memcpy_ssd2gpu_wait_multi - synchronization of multiple dma_tasks
+ *
+ * It waits for completion of at least @nr_required tasks in @witems, or
+ * until @timeout (in jiffies) expired. Completed tasks are marked on the
+ * @witems, then it returns number of the completed tasks, or negative
+ * error code if timeout or signal. Also, tasks completed during the wait
+ * are marked even if error.
+ */
+static int
+strom_memcpy_ssd2gpu_wait_multi(strom_dma_wait_item *witems, int ntasks,
+								strom_file_context *fcontext,
+								int nr_required, long timeout)
+{
+	strom_dma_task_waiter *waiters;
+	int					ncompleted = 0;
+	int					i, retval = 0;
+
+	waiters = kmalloc(sizeof(strom_dma_task_waiter) * ntasks, GFP_KERNEL);
+	if (!waiters)
+		return -ENOMEM;
+	for (i=0; i < ntasks; i++)
+	{
+		strom_init_dma_task_waiter(&waiters[i], witems[i].dma_task_id);
+		witems[i].status = 0;
+		witems[i].completed = 0;
+	}
+
+	for (;;)
+	{
+		/* register to the waitqueues of the running tasks */
+		for (i=0; i < ntasks; i++)
+		{
+			int		hindex;
+
+			if (witems[i].completed)
+				continue;
+			hindex = strom_dma_task_index(witems[i].dma_task_id);
+			prepare_to_wait(&strom_dma_task_waitq[hindex],
+							&waiters[i].wait, TASK_INTERRUPTIBLE);
+		}
+		/* then, check status of the tasks */
+		for (i=0; i < ntasks; i++)
 		{
-			if (dtask->dma_task_id == dma_task_id)
+			if (witems[i].completed)
+				continue;
+			if (!strom_check_dma_task(witems[i].dma_task_id, fcontext,
+									  &witems[i].status))
 			{
-				task_is_running = true;
-				break;
+				witems[i].completed = 1;
+				ncompleted++;
 			}
 		}
-		if (has_spinlock)
-			spin_unlock_irqrestore(lock, flags);
-		else
-			rcu_read_unlock();
-
-		if (!task_is_running)
+		if (ncompleted >= nr_required)
 			break;
 		if (signal_pending(current))
 		{
 			retval = -EINTR;
 			break;
 		}
-		/* wait for completion of DMA task */
-		prepare_to_wait(waitq, &__wait, task_state);
-		schedule();
+		if (timeout == 0)
+		{
+			retval = -ETIMEDOUT;
+			break;
+		}
+		timeout = schedule_timeout(timeout);
 	}
-out:
-	finish_wait(waitq, &__wait);
+	__set_current_state(TASK_RUNNING);
+	for (i=0; i < ntasks; i++)
+	{
+		int		hindex = strom_dma_task_index(witems[i].dma_task_id);
+
+		finish_wait(&strom_dma_task_waitq[hindex], &waiters[i].wait);
+	}
+	kfree(waiters);
+
+	return (retval ? retval : ncompleted);
+}
+
+/*
+ * NOTE: The submitter of DMA task may have SSD2GPU requests staged but not
+ * notified to the controller yet, and they already hold the tags and their
+ * timers are running. So, the submitter has to flush them prior to any
+ * operations that may block. The helpers below try the non-blocking way
+ * first, then flush the pending requests if it would block.
+ */
+
+/*
+ * strom_dma_task_lock_page - find_lock_page() for the submitter
+ */
+static struct page *
+strom_dma_task_lock_page(strom_dma_task *dtask,
+						 struct address_space *mapping, pgoff_t index)
+{
+	struct page	   *fpage;
+
+repeat:
+	fpage = find_get_page(mapping, index);
+	if (!fpage)
+		return NULL;
+	if (!trylock_page(fpage))
+	{
+		strom_flush_submission(dtask);
+		lock_page(fpage);
+	}
+	/* page might be truncated prior to the lock */
+	if (unlikely(fpage->mapping != mapping))
+	{
+		unlock_page(fpage);
+		page_cache_release(fpage);
+		goto repeat;
+	}
+	return fpage;
+}
+
+/*
+ * strom_dma_task_lookup_extent - strom_lookup_extent() for the submitter
+ */
+static int
+strom_dma_task_lookup_extent(strom_dma_task *dtask,
+							 loff_t fpos, size_t length,
+							 sector_t *p_lba, unsigned int *p_nr_blocks)
+{
+	struct inode   *inode = dtask->filp->f_inode;
+	sector_t		iblock = (fpos >> dtask->blocksz_shift);
+	int				retval;
 
+	retval = strom_lookup_extent(inode, iblock, length,
+								 p_lba, p_nr_blocks, true);
+	if (retval == -EAGAIN)
+	{
+		strom_flush_submission(dtask);
+		retval = strom_lookup_extent(inode, iblock, length,
+									 p_lba, p_nr_blocks, false);
+	}
 	return retval;
 }
 
+/*
+ * strom_dma_task_gpu_page_iomap - strom_get_gpu_page_iomap() for the
+ * submitter; ioremap_wc() of the GPU page not mapped yet may sleep.
+ */
+static void __iomem *
+strom_dma_task_gpu_page_iomap(strom_dma_task *dtask, int index)
+{
+	mapped_gpu_memory  *mgmem = dtask->mgmem;
+	void __iomem	   *iomap = ACCESS_ONCE(mgmem->iomap_cache[index]);
+
+	if (iomap)
+		return iomap;
+	strom_flush_submission(dtask);
+	return strom_get_gpu_page_iomap(mgmem, index);
+}
+
+/*
+ * strom_dma_task_submit_ram2gpu - submit_ram2gpu_memcpy() for the submitter
+ */
+static int
+strom_dma_task_submit_ram2gpu(strom_dma_task *dtask)
+{
+	strom_flush_submission(dtask);
+	return submit_ram2gpu_memcpy(dtask);
+}
+
+/*
+ * strom_find_lock_cached_page - it returns the locked page cache, if it
+ * shall be copied by RAM2GPU. Elsewhere, NULL; SSD2GPU is preferable.
+ */
+static struct page *
+strom_find_lock_cached_page(strom_dma_task *dtask,
+							struct address_space *mapping, pgoff_t index)
+{
+	struct page	   *fpage = strom_dma_task_lock_page(dtask, mapping, index);
+	bool			use_ram2gpu;
+
+	if (!fpage)
+		return NULL;
+	if (strom_page_is_stale_on_ssd(fpage))
+		return fpage;
+	if (!PageUptodate(fpage))
+		use_ram2gpu = false;	/* contents are not read yet */
+	else
+		use_ram2gpu = dtask->use_ram2gpu;
+	if (use_ram2gpu)
+		return fpage;
+	unlock_page(fpage);
+	page_cache_release(fpage);
+	return NULL;
+}
+
 /*
  * do_ssd2gpu_async_memcpy - kicker of asyncronous DMA requests
  */
@@ -1173,8 +3614,8 @@ do_ssd2gpu_async_memcpy(strom_dma_task *dtask,
 {
 	mapped_gpu_memory  *mgmem = dtask->mgmem;
 	struct file		   *filp = dtask->filp;
-	struct page		   *fpage;
-	long				retval;
+	struct page		   *fpage = NULL;
+	long				retval = 0;
 	size_t				i_size;
 	unsigned int		i;
 
@@ -1186,6 +3627,14 @@ do_ssd2gpu_async_memcpy(strom_dma_task *dtask,
 		loff_t		end;
 		size_t		curr_offset;
 
+		dchunk->ram2gpu_len = 0;
+
+		/* pending requests shall be dropped, if cancelled */
+		if (unlikely(ACCESS_ONCE(dtask->cancelled)))
+		{
+			retval = -ECANCELED;
+			break;
+		}
 		if (dchunk->length == 0)
 			continue;
 
@@ -1199,6 +3648,13 @@ do_ssd2gpu_async_memcpy(strom_dma_task *dtask,
 			curr_offset + dchunk->length > mgmem->map_length)
 			return -ERANGE;
 
+		/* path of the cached pages in this chunk */
+		dtask->use_ram2gpu =
+			(ACCESS_ONCE(strom_path_cost[STROM_PATH__RAM2GPU]) <=
+			 ACCESS_ONCE(strom_path_cost[STROM_PATH__SSD2GPU]));
+		if (strom_planner_probe())
+			dtask->use_ram2gpu = !dtask->use_ram2gpu;
+
 		/*
 		 * Submit if pending SSD2GPU DMA request is not merginable with
 		 * the next chunk.
@@ -1242,16 +3698,16 @@ do_ssd2gpu_async_memcpy(strom_dma_task *dtask,
 				   (page_len & (dtask->blocksz - 1)) == 0);
 
 			/*
-			 * NOTE: Theoretical performance of RAM-to-GPU transfer should
-			 * be faster than SSD-to-GPU, however, we cannot use DMA engine
-			 * of GPU device, thus, we have to map PCI BAR region with
-			 * ioremap() then copy values by CPU.
-			 * It tends to use unreasonably small packet even if SSE/AVX
-			 * registers are used.
-			 * So, as a workaround, RAM-to-GPU transfer shall be applied
-			 * only when the cached page is dirty.
+			 * NOTE: Cached page is copied by RAM2GPU if it is stale on
+			 * the storage, or if RAM2GPU is cheaper than SSD2GPU as of
+			 * the current cost model. Elsewhere, it is sent by SSD2GPU
+			 * DMA as if it is not cached.
+			 *
+			 * @fpage may be already looked up during the extent walk.
 			 */
-			fpage = find_lock_page(filp->f_mapping, pos >> PAGE_CACHE_SHIFT);
+			if (!fpage)
+				fpage = strom_find_lock_cached_page(dtask, filp->f_mapping,
+												pos >> PAGE_CACHE_SHIFT);
 			if (fpage)
 			{
 				/* Submit SSD2GPU DMA, if any pending request */
@@ -1261,7 +3717,7 @@ do_ssd2gpu_async_memcpy(strom_dma_task *dtask,
 					if (retval)
 					{
 						prDebug("submit_ssd2gpu_memcpy() = %ld", retval);
-						return retval;
+						goto out;
 					}
 					Assert(dtask->nr_blocks == 0);
 				}
@@ -1283,11 +3739,11 @@ do_ssd2gpu_async_memcpy(strom_dma_task *dtask,
 					/* submit if any pending request */
 					if (dtask->nr_fpages > 0)
 					{
-						retval = submit_ram2gpu_memcpy(dtask);
+						retval = strom_dma_task_submit_ram2gpu(dtask);
 						if (retval)
 						{
 							prDebug("submit_ram2gpu_memcpy() = %ld", retval);
-							return retval;
+							goto out;
 						}
 						Assert(dtask->nr_fpages == 0);
 					}
@@ -1298,17 +3754,20 @@ do_ssd2gpu_async_memcpy(strom_dma_task *dtask,
 					dtask->nr_fpages		= 1;
 					dtask->dest_offset		= curr_offset;
 				}
+				dchunk->ram2gpu_len += page_len;
+				fpage = NULL;
 			}
 			else
 			{
-				struct buffer_head	bh;
 				sector_t			lba_curr;
 				unsigned int		nr_blocks;
+				size_t				extent_len;
+				size_t				run_len;
 
 				/* Submit RAM2GPU Async Memcpy if any */
 				if (dtask->nr_fpages > 0)
 				{
-					retval = submit_ram2gpu_memcpy(dtask);
+					retval = strom_dma_task_submit_ram2gpu(dtask);
 					if (retval)
 					{
 						prDebug("submit_ram2gpu_memcpy() = %ld", retval);
@@ -1317,66 +3776,243 @@ do_ssd2gpu_async_memcpy(strom_dma_task *dtask,
 					Assert(dtask->nr_fpages == 0);
 				}
 
-				/* Lookup underlying block number */
-				memset(&bh, 0, sizeof(bh));
-				bh.b_size = dtask->blocksz;
+				/* Lookup underlying extent */
+				retval = strom_dma_task_lookup_extent(dtask, pos, end - pos,
+													  &lba_curr, &nr_blocks);
+				if (retval)
+				{
+					prDebug("strom_lookup_extent() = %ld", retval);
+					return retval;
+				}
+				extent_len = ((size_t)nr_blocks << dtask->blocksz_shift);
+
+				/*
+				 * Walk on the following pages within the extent, as long as
+				 * they are not cached. A cached page stops the walk, and
+				 * shall be processed on the next loop.
+				 */
+				run_len = Min(page_len, extent_len);
+				while (run_len == page_len && pos + run_len < end)
+				{
+					loff_t	next_pos = pos + run_len;
+					size_t	next_len = Min(PAGE_CACHE_SIZE, end - next_pos);
+
+					if (run_len + next_len > extent_len)
+						break;
+					fpage = strom_find_lock_cached_page(dtask, filp->f_mapping,
+											next_pos >> PAGE_CACHE_SHIFT);
+					if (fpage)
+						break;
+					run_len += next_len;
+					page_len = run_len;
+				}
+				page_len = run_len;
+
+				retval = merge_ssd2gpu_memcpy(dtask, lba_curr,
+											  page_len >> dtask->blocksz_shift,
+											  curr_offset);
+				if (retval)
+					goto out;
+			}
+			curr_offset += page_len;
+			pos += page_len;
+		}
+		Assert(!fpage);
+	}
+	/* Submit pending SSD2GPU request, if any */
+	if (dtask->nr_blocks > 0)
+	{
+		Assert(dtask->nr_fpages == 0);
+		retval = submit_ssd2gpu_memcpy(dtask);
+		if (retval)
+			prDebug("submit_ssd2gpu_memcpy() = %ld", retval);
+	}
+	else if (dtask->nr_fpages > 0)
+	{
+		Assert(dtask->nr_blocks == 0);
+		retval = strom_dma_task_submit_ram2gpu(dtask);
+		if (retval)
+			prDebug("submit_ram2gpu_memcpy() = %ld", retval);
+	}
+out:
+	/* release the page cache looked up but not consumed */
+	if (fpage)
+	{
+		unlock_page(fpage);
+		page_cache_release(fpage);
+	}
+	return retval;
+}
+
+/*
+ * __memcpy_ssd2gpu_async - creates a DMA task and submits its requests
+ *
+ * On success, it returns zero and the ID of DMA task already in progress.
+ * Elsewhere, it returns an error code after the synchronization of the
+ * partially submitted DMA requests, if any.
+ * The ID is also written to @u_dma_task_id prior to submission of the
+ * requests, so other threads can cancel the DMA task during the walk on
+ * the chunks. It is meaningless if this function returns an error.
+ */
+static long
+__memcpy_ssd2gpu_async(unsigned long handle,
+					   int fdesc,
+					   int nchunks,
+					   strom_dma_chunk *dchunks,
+					   struct file *ioctl_filp,
+					   unsigned long __user *u_dma_task_id,
+					   unsigned long *p_dma_task_id,
+					   bool do_polling)
+{
+	strom_dma_task	   *dtask;
+	struct nvme_queue  *poll_nvmeq = NULL;
+	unsigned long		dma_task_id;
+	long				retval;
+	int					i;
+
+	/* construct dma_task and dma_state */
+	dtask = strom_create_dma_task(handle, fdesc, ioctl_filp);
+	if (IS_ERR(dtask))
+		return PTR_ERR(dtask);
+	dma_task_id = dtask->dma_task_id;
+	for (i=0; i < nchunks; i++)
+		dtask->nr_bytes += dchunks[i].length;
+
+	/* publish the dma_task_id first, to be cancellable during the walk */
+	if (put_user(dma_task_id, u_dma_task_id))
+		retval = -EFAULT;
+	else
+	{
+		/* then, submit asynchronous DMA requests */
+		retval = do_ssd2gpu_async_memcpy(dtask, nchunks, dchunks);
+	}
+	strom_freeze_dma_task(dtask);
+	if (do_polling && sync_polling > 0 && !retval && !dtask->no_polling)
+		poll_nvmeq = dtask->poll_nvmeq;
+	if (poll_nvmeq)
+	{
+		/*
+		 * dtask is released after RCU grace period, so it is safe to
+		 * reference the dtask within the read section, even if our
+		 * reference is the last one.
+		 */
+		rcu_read_lock();
+		strom_put_dma_task(dtask, retval);
+		strom_memcpy_ssd2gpu_poll(dtask, poll_nvmeq);
+		rcu_read_unlock();
+	}
+	else
+	{
+		/* release resources no longer referenced */
+		strom_put_dma_task(dtask, retval);
+	}
+
+	if (retval)
+		strom_memcpy_ssd2gpu_wait(dma_task_id, ioctl_filp->private_data,
+								  NULL, TASK_KILLABLE, MAX_SCHEDULE_TIMEOUT);
+	else
+		*p_dma_task_id = dma_task_id;
+
+	return retval;
+}
+
+/*
+ * memcpy_ssd2gpu_sync_small - fast path of the synchronous SSD2GPU memcpy
+ *
+ * A small request, likely fits a few NVMe commands, is dominated by the
+ * fixed cost of DMA task management. So, it runs the DMA task without the
+ * hash slots, then polls and waits for its completion.
+ * The DMA task is invisible to the cancel, the watchdog and the completion
+ * notification, so it is used only if sync_polling > 0 and the caller waits
+ * infinitely. Fatal signal breaks the wait; then the DMA task is abandoned
+ * and released by the last completion of its requests.
+ */
+#define STROM_SYNC_SMALL_MAXLEN		(64 * 1024)
+
+static long
+memcpy_ssd2gpu_sync_small(unsigned long handle, int fdesc,
+						  strom_dma_chunk *dchunk, long *p_dma_status)
+{
+	strom_dma_task	   *dtask;
+	struct page		   *file_pages[(STROM_SYNC_SMALL_MAXLEN >>
+									PAGE_CACHE_SHIFT) + 1];
+	long				retval;
 
-				retval = strom_get_block(filp->f_inode,
-										 pos >> dtask->blocksz_shift,
-										 &bh, 0);
-				if (retval)
-				{
-					prDebug("strom_get_block() = %ld", retval);
-					return retval;
-				}
-				lba_curr = bh.b_blocknr + (page_ofs >> dtask->blocksz_shift);
-				nr_blocks = (page_len >> dtask->blocksz_shift);
-				/* Is it merginable with the pending request? */
-				if (dtask->nr_blocks > 0 &&
-					dtask->nr_blocks + nr_blocks <= dtask->max_nblocks &&
-					dtask->src_block + dtask->nr_blocks == lba_curr)
-				{
-					dtask->nr_blocks += nr_blocks;
-				}
-				else
-				{
-					/* Submit the latest pending blocks but not merginable */
-					if (dtask->nr_blocks > 0)
-					{
-						retval = submit_ssd2gpu_memcpy(dtask);
-						if (retval)
-						{
-							prDebug("submit_ssd2gpu_memcpy() = %ld", retval);
-							return retval;
-						}
-						Assert(dtask->nr_blocks == 0);
-					}
-					/* This block becomes new head of the pending request */
-					dtask->src_block = lba_curr;
-					dtask->nr_blocks = nr_blocks;
-					dtask->dest_offset = curr_offset;
-				}
-			}
-			curr_offset += page_len;
-			pos += page_len;
-		}
+	Assert(dchunk->length <= STROM_SYNC_SMALL_MAXLEN);
+	dtask = strom_mempool_alloc(&strom_dma_task_mempool);
+	if (!dtask)
+		return -ENOMEM;
+	retval = strom_init_dma_task(dtask, handle, fdesc);
+	if (retval)
+	{
+		strom_mempool_free(&strom_dma_task_mempool, dtask);
+		return retval;
 	}
-	/* Submit pending SSD2GPU request, if any */
-	if (dtask->nr_blocks > 0)
+	dtask->dma_task_id	= 0;
+	dtask->hindex		= -1;
+	dtask->ioctl_filp	= NULL;
+	dtask->fcontext		= NULL;
+	dtask->untracked	= true;
+	init_completion(&dtask->sync_done);
+	dtask->file_pages	= file_pages;
+	dtask->nr_bytes		= dchunk->length;
+	/* reference of the waiter */
+	strom_get_dma_task(dtask);
+
+	retval = do_ssd2gpu_async_memcpy(dtask, 1, dchunk);
+	/* same as strom_freeze_dma_task, but no staging buffer to release */
+	strom_flush_submission(dtask);
+	dtask->file_pages	= NULL;
+	dtask->frozen		= true;
+	barrier();
+	strom_put_dma_task(dtask, retval);
+
+	if (!retval && dtask->poll_nvmeq && !dtask->no_polling)
+		strom_memcpy_ssd2gpu_poll(dtask, dtask->poll_nvmeq);
+	if (wait_for_completion_killable(&dtask->sync_done))
 	{
-		Assert(dtask->nr_fpages == 0);
-		retval = submit_ssd2gpu_memcpy(dtask);
-		if (retval)
-			prDebug("submit_ssd2gpu_memcpy() = %ld", retval);
+		/* abandon the DMA task; the last request releases it */
+		strom_put_dma_task(dtask, 0);
+		return -EINTR;
 	}
-	else if (dtask->nr_fpages > 0)
+	*p_dma_status = dtask->dma_status;
+	strom_put_dma_task(dtask, 0);
+
+	if (retval)
+		return retval;
+	return (*p_dma_status ? -EIO : 0);
+}
+
+/*
+ * strom_timeout_jiffies - timeout_ms of the ioctl(2) commands in jiffies
+ *
+ * 0 means infinite, and negative means no wait.
+ */
+static inline long
+strom_timeout_jiffies(long timeout_ms)
+{
+	if (timeout_ms == 0)
+		return MAX_SCHEDULE_TIMEOUT;
+	if (timeout_ms < 0)
+		return 0;
+	return msecs_to_jiffies(timeout_ms);
+}
+
+/*
+ * strom_put_chunk_results - write back the path chosen for each chunk
+ */
+static int
+strom_put_chunk_results(strom_dma_chunk __user *uchunks,
+						strom_dma_chunk *dchunks, int nchunks)
+{
+	int		i;
+
+	for (i=0; i < nchunks; i++)
 	{
-		Assert(dtask->nr_blocks == 0);
-		retval = submit_ram2gpu_memcpy(dtask);
-		if (retval)
-			prDebug("submit_ram2gpu_memcpy() = %ld", retval);
+		if (put_user(dchunks[i].ram2gpu_len, &uchunks[i].ram2gpu_len))
+			return -EFAULT;
 	}
-	return retval;
+	return 0;
 }
 
 /*
@@ -1389,7 +4025,6 @@ ioctl_memcpy_ssd2gpu_async(StromCmd__MemCpySsdToGpu __user *uarg,
 {
 	StromCmd__MemCpySsdToGpu karg;
 	strom_dma_chunk	   *dchunks;
-	strom_dma_task	   *dtask;
 	unsigned long		dma_task_id;
 	long				retval;
 
@@ -1407,34 +4042,145 @@ ioctl_memcpy_ssd2gpu_async(StromCmd__MemCpySsdToGpu __user *uarg,
 		return -EFAULT;
 	}
 
-	/* construct dma_task and dma_state */
-	dtask = strom_create_dma_task(karg.handle,
-								  karg.fdesc,
-								  ioctl_filp);
-	if (IS_ERR(dtask))
-		return PTR_ERR(dtask);
-	dma_task_id = dtask->dma_task_id;
+	/* fast path for a small synchronous request */
+	if (do_sync &&
+		sync_polling > 0 &&
+		karg.timeout_ms == 0 &&
+		karg.nchunks == 1 &&
+		dchunks[0].length <= STROM_SYNC_SMALL_MAXLEN)
+	{
+		long	dma_status = 0;
 
-	/* then, submit asynchronous DMA requests */
-	retval = do_ssd2gpu_async_memcpy(dtask, karg.nchunks, dchunks);
-	/* no async jobs will acquire the dtask any more */
-	dtask->frozen = true;
-	barrier();
-	/* release resources no longer referenced */
-	strom_put_dma_task(dtask, retval);
+		retval = memcpy_ssd2gpu_sync_small(karg.handle, karg.fdesc,
+										   &dchunks[0], &dma_status);
+		if (put_user(0UL, &uarg->dma_task_id) ||
+			put_user(dma_status, &uarg->status) ||
+			(!retval && strom_put_chunk_results(uarg->chunks, dchunks, 1)))
+			retval = -EFAULT;
+		kfree(dchunks);
+		return retval;
+	}
 
-	/* inform the dma_task_id to userspace */
-	if (retval == 0 && put_user(dma_task_id, &uarg->dma_task_id))
-		retval = -EFAULT;
-	/* synchronization if necessary */
-	if (retval || do_sync)
-		strom_memcpy_ssd2gpu_wait(dma_task_id, NULL, TASK_UNINTERRUPTIBLE);
+	retval = __memcpy_ssd2gpu_async(karg.handle,
+									karg.fdesc,
+									karg.nchunks,
+									dchunks,
+									ioctl_filp,
+									&uarg->dma_task_id,
+									&dma_task_id,
+									do_sync);
+	if (retval)
+	{
+		kfree(dchunks);
+		return retval;
+	}
 
+	/* inform the chosen paths to userspace; dma_task_id is already set */
+	retval = strom_put_chunk_results(uarg->chunks, dchunks, karg.nchunks);
 	kfree(dchunks);
+	if (retval)
+	{
+		strom_memcpy_ssd2gpu_wait(dma_task_id, ioctl_filp->private_data,
+								  NULL, TASK_KILLABLE, MAX_SCHEDULE_TIMEOUT);
+		return -EFAULT;
+	}
 
+	/* synchronization if necessary */
+	if (do_sync)
+	{
+		long	dma_status = 0;
+		long	timeout = strom_timeout_jiffies(karg.timeout_ms);
+
+		retval = strom_memcpy_ssd2gpu_wait(dma_task_id,
+										   ioctl_filp->private_data,
+										   &dma_status,
+										   TASK_KILLABLE, timeout);
+		if (put_user(dma_status, &uarg->status))
+			retval = -EFAULT;
+	}
 	return retval;
 }
 
+/*
+ * ioctl(2) handler for STROM_IOCTL__MEMCPY_SSD2GPU_SUBMIT
+ */
+static long
+ioctl_memcpy_ssd2gpu_submit(StromCmd__MemCpySsdToGpuSubmit __user *uarg,
+							struct file *ioctl_filp)
+{
+	StromCmd__MemCpySsdToGpuSubmit karg;
+	strom_dma_request	dreq;
+	strom_dma_chunk	   *dchunks = NULL;
+	int					nrooms = 0;
+	int					i;
+
+	if (copy_from_user(&karg, uarg,
+					   offsetof(StromCmd__MemCpySsdToGpuSubmit, requests)))
+		return -EFAULT;
+	if (karg.nrequests < 0)
+		return -EINVAL;
+
+	karg.nsubmitted = 0;
+	for (i=0; i < karg.nrequests; i++)
+	{
+		strom_dma_request __user *ureq = &uarg->requests[i];
+
+		if (copy_from_user(&dreq, ureq, sizeof(strom_dma_request)))
+			goto fault;
+		dreq.dma_task_id = 0;
+
+		if (dreq.nchunks <= 0)
+			dreq.status = -EINVAL;
+		else
+		{
+			/* chunks buffer is reused as long as it is large enough */
+			if (dreq.nchunks > nrooms)
+			{
+				kfree(dchunks);
+				nrooms = Max(dreq.nchunks, 64);
+				dchunks = kmalloc(sizeof(strom_dma_chunk) * nrooms,
+								  GFP_KERNEL);
+				if (!dchunks)
+					nrooms = 0;
+			}
+
+			if (!dchunks)
+				dreq.status = -ENOMEM;
+			else if (copy_from_user(dchunks, dreq.chunks,
+									sizeof(strom_dma_chunk) * dreq.nchunks))
+				dreq.status = -EFAULT;
+			else
+				dreq.status = __memcpy_ssd2gpu_async(dreq.handle,
+													 dreq.fdesc,
+													 dreq.nchunks,
+													 dchunks,
+													 ioctl_filp,
+													 &ureq->dma_task_id,
+													 &dreq.dma_task_id,
+													 false);
+		}
+		if (dreq.status == 0)
+		{
+			karg.nsubmitted++;
+			if (strom_put_chunk_results(dreq.chunks, dchunks, dreq.nchunks))
+				goto fault;
+		}
+		/* write back the result of this request */
+		if (put_user(dreq.dma_task_id, &ureq->dma_task_id) ||
+			put_user(dreq.status, &ureq->status))
+			goto fault;
+	}
+	kfree(dchunks);
+
+	if (put_user(karg.nsubmitted, &uarg->nsubmitted))
+		return -EFAULT;
+	return 0;
+
+fault:
+	kfree(dchunks);
+	return -EFAULT;
+}
+
 /*
  * ioctl(2) handler for STROM_IOCTL__MEMCPY_SSD2GPU_WAIT
  */
@@ -1450,14 +4196,93 @@ ioctl_memcpy_ssd2gpu_wait(StromCmd__MemCpySsdToGpuWait __user *uarg,
 
 	karg.status = 0;
 	retval = strom_memcpy_ssd2gpu_wait(karg.dma_task_id,
+									   ioctl_filp->private_data,
 									   &karg.status,
-									   TASK_INTERRUPTIBLE);
+									   TASK_INTERRUPTIBLE,
+									   strom_timeout_jiffies(karg.timeout_ms));
 	if (copy_to_user(uarg, &karg, sizeof(StromCmd__MemCpySsdToGpuWait)))
 		return -EFAULT;
 
 	return retval;
 }
 
+/*
+ * ioctl(2) handler for STROM_IOCTL__MEMCPY_SSD2GPU_CANCEL
+ */
+static int
+ioctl_memcpy_ssd2gpu_cancel(StromCmd__MemCpySsdToGpuCancel __user *uarg,
+							struct file *ioctl_filp)
+{
+	StromCmd__MemCpySsdToGpuCancel karg;
+
+	if (copy_from_user(&karg, uarg, sizeof(StromCmd__MemCpySsdToGpuCancel)))
+		return -EFAULT;
+
+	return strom_cancel_dma_task(karg.dma_task_id, ioctl_filp);
+}
+
+/*
+ * ioctl(2) handler for STROM_IOCTL__MEMCPY_SSD2GPU_WAIT_MULTI
+ */
+#define STROM_WAIT_MULTI_MAX_TASKS		1024
+
+static int
+ioctl_memcpy_ssd2gpu_wait_multi(StromCmd__MemCpySsdToGpuWaitMulti __user *uarg,
+								struct file *ioctl_filp)
+{
+	StromCmd__MemCpySsdToGpuWaitMulti karg;
+	strom_dma_wait_item *witems;
+	long		timeout;
+	int			retval;
+
+	if (copy_from_user(&karg, uarg,
+					   offsetof(StromCmd__MemCpySsdToGpuWaitMulti, witems)))
+		return -EFAULT;
+	if (karg.ntasks <= 0 ||
+		karg.ntasks > STROM_WAIT_MULTI_MAX_TASKS ||
+		karg.nr_required <= 0 ||
+		karg.nr_required > karg.ntasks)
+		return -EINVAL;
+	timeout = strom_timeout_jiffies(karg.timeout_ms);
+
+	witems = kmalloc(sizeof(strom_dma_wait_item) * karg.ntasks, GFP_KERNEL);
+	if (!witems)
+		return -ENOMEM;
+	if (copy_from_user(witems, uarg->witems,
+					   sizeof(strom_dma_wait_item) * karg.ntasks))
+	{
+		retval = -EFAULT;
+		goto out;
+	}
+
+	retval = strom_memcpy_ssd2gpu_wait_multi(witems, karg.ntasks,
+											 ioctl_filp->private_data,
+											 karg.nr_required, timeout);
+	if (retval == -ENOMEM)
+		goto out;
+	/* write back the status, even if timeout or signal */
+	karg.ncompleted = 0;
+	if (retval >= 0)
+	{
+		karg.ncompleted = retval;
+		retval = 0;
+	}
+	else
+	{
+		int		i;
+
+		for (i=0; i < karg.ntasks; i++)
+			karg.ncompleted += witems[i].completed;
+	}
+	if (put_user(karg.ncompleted, &uarg->ncompleted) ||
+		copy_to_user(uarg->witems, witems,
+					 sizeof(strom_dma_wait_item) * karg.ntasks))
+		retval = -EFAULT;
+out:
+	kfree(witems);
+	return retval;
+}
+
 /*
  * write back a chunk to user buffer
  */
@@ -1475,11 +4300,15 @@ __memcpy_ssd2gpu_writeback(strom_dma_task *dtask,
 
 	for (i=0; i < nr_pages; i++)
 	{
+		u64		start_ns = ktime_to_ns(ktime_get());
+		int		path = STROM_PATH__WRITEBACK;
+
 		fpage = dtask->file_pages[i];
 
 		/* Synchronous read, if not cached */
 		if (!fpage)
 		{
+			path = STROM_PATH__HOSTREAD;
 			fpage = read_mapping_page(filp->f_mapping,
 									  (fpos >> PAGE_CACHE_SHIFT) + i,
 									  NULL);
@@ -1519,6 +4348,8 @@ __memcpy_ssd2gpu_writeback(strom_dma_task *dtask,
 			retval = -EFAULT;
 			break;
 		}
+		strom_update_path_cost(path, ktime_to_ns(ktime_get()) - start_ns,
+							   PAGE_CACHE_SIZE);
 		dest_uaddr += PAGE_CACHE_SIZE;
 	}
 
@@ -1542,55 +4373,62 @@ static inline int
 __memcpy_ssd2gpu_submit_dma(strom_dma_task *dtask,
 							int nr_pages,
 							loff_t fpos,
-							loff_t dest_offset,
-							unsigned int *p_nr_dma_submit,
-							unsigned int *p_nr_dma_blocks)
+							loff_t dest_offset)
 {
 	mapped_gpu_memory  *mgmem = dtask->mgmem;
 	struct file		   *filp = dtask->filp;
 	struct page		   *fpage;
-	nvidia_p2p_page_table_t *page_table = mgmem->page_table;
-	struct buffer_head	bh;
-	unsigned int		nr_blocks;
-	uint64_t			phy_addr;
+	char __iomem	   *dest_iomap;
 	loff_t				curr_offset = dest_offset;
+	bool				in_copy = false;	/* in strom_memcpy_toio_begin */
+	bool				use_simd = false;
 	int					i, j, retval = 0;
 
-	for (i=0; i < nr_pages; i++, fpos += PAGE_CACHE_SIZE)
+	/*
+	 * A copy section is kept across the consecutive stale pages, and closed
+	 * prior to the operations that may sleep.
+	 */
+#define LEAVE_COPY_SECTION()						\
+	do {											\
+		if (in_copy)								\
+			strom_memcpy_toio_end(use_simd);		\
+		in_copy = false;							\
+	} while(0)
+
+	i = 0;
+	while (i < nr_pages)
 	{
 		fpage = dtask->file_pages[i];
-		if (fpage && PageDirty(fpage))
+		if (fpage && strom_page_is_stale_on_ssd(fpage))
 		{
 			size_t		page_len = PAGE_CACHE_SIZE;
 			size_t		page_ofs = 0;
 			size_t		copy_len;
 			char	   *saddr;
-			char	   *daddr;
+			char __iomem *daddr;
 
 			/* submit SSD2GPU DMA */
 			if (dtask->nr_blocks > 0)
 			{
-				(*p_nr_dma_submit)++;
-				(*p_nr_dma_blocks) += dtask->nr_blocks;
-				submit_ssd2gpu_memcpy(dtask);
+				LEAVE_COPY_SECTION();
+				retval = submit_ssd2gpu_memcpy(dtask);
+				if (retval)
+					goto out;
 			}
-			/* dirty page must be copied by CPU, synchronously */
+			/* stale page must be copied by CPU, synchronously */
 			while (page_len > 0)
 			{
 				j = curr_offset >> mgmem->gpu_page_shift;
-				if (!dtask->dest_iomap || j != dtask->dest_index)
+				dest_iomap = ACCESS_ONCE(mgmem->iomap_cache[j]);
+				if (!dest_iomap)
 				{
-					if (dtask->dest_iomap)
-						iounmap(dtask->dest_iomap);
-					phy_addr = page_table->pages[j]->physical_address;
-					dtask->dest_iomap = ioremap_wc(phy_addr,
-												   mgmem->gpu_page_sz);
-					if (!dtask->dest_iomap)
+					LEAVE_COPY_SECTION();
+					dest_iomap = strom_dma_task_gpu_page_iomap(dtask, j);
+					if (!dest_iomap)
 					{
 						retval = -ENOMEM;
 						goto out;
 					}
-					dtask->dest_index = j;
 				}
 				copy_len = page_len;
 				if (j != ((curr_offset + copy_len) >> mgmem->gpu_page_shift))
@@ -1598,65 +4436,83 @@ __memcpy_ssd2gpu_submit_dma(strom_dma_task *dtask,
 								(curr_offset & (mgmem->gpu_page_sz - 1)));
 				Assert(copy_len <= page_len);
 				/* Sync copy by CPU */
-				daddr = (dtask->dest_iomap +
+				daddr = (dest_iomap +
 						 (curr_offset & (mgmem->gpu_page_sz - 1)));
+				if (!in_copy)
+				{
+					use_simd = strom_memcpy_toio_begin();
+					in_copy = true;
+				}
 				saddr = kmap_atomic(fpage);
-				memcpy_toio(daddr, saddr + page_ofs, copy_len);
+				strom_memcpy_toio(daddr, saddr + page_ofs, copy_len,
+								  use_simd);
 				kunmap_atomic(saddr);
 
 				curr_offset += copy_len;
 				page_ofs += copy_len;
 				page_len -= copy_len;
 			}
+			unlock_page(fpage);
+			page_cache_release(fpage);
+			i++;
+			fpos += PAGE_CACHE_SIZE;
 		}
 		else
 		{
-			/* lookup the source block number */
-			memset(&bh, 0, sizeof(bh));
-			bh.b_size = dtask->blocksz;
-
-			retval = strom_get_block(filp->f_inode,
-									 fpos >> dtask->blocksz_shift,
-									 &bh, 0);
-			if (retval)
+			loff_t			pos = fpos;
+			loff_t			end;
+			sector_t		lba;
+			unsigned int	nr_blocks;
+			size_t			length;
+			int				k;
+
+			LEAVE_COPY_SECTION();
+			/* the following pages not stale are also sent by DMA */
+			for (k=i+1; k < nr_pages; k++)
 			{
-				prError("strom_get_block: %d", retval);
-				goto out;
+				fpage = dtask->file_pages[k];
+				if (fpage && strom_page_is_stale_on_ssd(fpage))
+					break;
 			}
-			nr_blocks = PAGE_CACHE_SIZE >> dtask->blocksz_shift;
-
-			/* merge with pending request if possible */
-			if (dtask->nr_blocks > 0 &&
-				dtask->nr_blocks + nr_blocks <= dtask->max_nblocks &&
-				dtask->src_block + dtask->nr_blocks == bh.b_blocknr &&
-				dtask->dest_offset +
-				dtask->nr_blocks * dtask->blocksz == curr_offset)
+			end = fpos + ((loff_t)(k - i) << PAGE_CACHE_SHIFT);
+
+			/* lookup the source blocks, then merge to the pending request */
+			while (pos < end)
 			{
-				dtask->nr_blocks += nr_blocks;
+				retval = strom_dma_task_lookup_extent(dtask, pos, end - pos,
+													  &lba, &nr_blocks);
+				if (retval)
+				{
+					prError("strom_lookup_extent: %d", retval);
+					goto out;
+				}
+				length = Min((size_t)nr_blocks << dtask->blocksz_shift,
+							 end - pos);
+				retval = merge_ssd2gpu_memcpy(dtask, lba,
+											  length >> dtask->blocksz_shift,
+											  curr_offset);
+				if (retval)
+					goto out;
+				pos += length;
+				curr_offset += length;
 			}
-			else
+
+			/* release page cache, if cached */
+			while (i < k)
 			{
-				/* submit pending SSD2GPU DMA */
-				if (dtask->nr_blocks > 0)
+				fpage = dtask->file_pages[i++];
+				if (fpage)
 				{
-					(*p_nr_dma_submit)++;
-					(*p_nr_dma_blocks) += dtask->nr_blocks;
-					submit_ssd2gpu_memcpy(dtask);
+					unlock_page(fpage);
+					page_cache_release(fpage);
 				}
-				dtask->src_block = bh.b_blocknr;
-				dtask->nr_blocks = nr_blocks;
-				dtask->dest_offset = curr_offset;
+				fpos += PAGE_CACHE_SIZE;
 			}
-			curr_offset += PAGE_CACHE_SIZE;
-		}
-		/* release page cache, if cached */
-		if (fpage)
-		{
-			unlock_page(fpage);
-			page_cache_release(fpage);
 		}
 	}
 out:
+	LEAVE_COPY_SECTION();
+#undef LEAVE_COPY_SECTION
 	/* Error? */
 	while (unlikely(i < nr_pages))
 	{
@@ -1692,10 +4548,7 @@ memcpy_ssd2gpu_writeback(strom_dma_task *dtask,
 	size_t			dest_offset;
 	unsigned int	nr_ram2gpu = 0;
 	unsigned int	nr_ssd2gpu = 0;
-	unsigned int	nr_dma_submit = 0;
-	unsigned int	nr_dma_blocks = 0;
 	unsigned int	n_pages = chunk_size >> PAGE_CACHE_SHIFT;
-	int				threshold = n_pages / 2;
 	size_t			i_size;
 	int				retval = 0;
 	int				i, j;
@@ -1703,7 +4556,9 @@ memcpy_ssd2gpu_writeback(strom_dma_task *dtask,
 	/* sanity checks */
 	if ((chunk_size & (PAGE_CACHE_SIZE - 1)) != 0 ||	/* alignment */
 		chunk_size < PAGE_CACHE_SIZE ||					/* >= 4KB */
-		chunk_size > STROM_DMA_SSD2GPU_MAXLEN)			/* <= 128KB */
+		chunk_size > (dtask->max_nblocks <<
+					  dtask->blocksz_shift) ||			/* <= max DMA len */
+		chunk_size > (STROM_RAM2GPU_MAXPAGES << PAGE_CACHE_SHIFT))
 		return -EINVAL;
 
 	dest_offset = mgmem->map_offset + buffer_offset;
@@ -1716,8 +4571,12 @@ memcpy_ssd2gpu_writeback(strom_dma_task *dtask,
 		uint32_t		curr_block_id = (block_nums ? block_nums[i] : ~0);
 		loff_t			fpos = file_pos[i];
 		struct page	   *fpage;
-		int				score = 0;
+		unsigned int	n_cached = 0;
+		unsigned int	n_stale = 0;
 
+		/* pending requests shall be dropped, if cancelled */
+		if (unlikely(ACCESS_ONCE(dtask->cancelled)))
+			break;
 		/* sanity checks */
 		if ((fpos & (PAGE_CACHE_SIZE - 1)) != 0)
 			return -EINVAL;
@@ -1726,30 +4585,38 @@ memcpy_ssd2gpu_writeback(strom_dma_task *dtask,
 
 		for (j=0; j < n_pages; j++, fpos += PAGE_CACHE_SIZE)
 		{
-			fpage = find_lock_page(filp->f_mapping,
-								   fpos >> PAGE_CACHE_SHIFT);
+			fpage = strom_dma_task_lock_page(dtask, filp->f_mapping,
+											 fpos >> PAGE_CACHE_SHIFT);
 			dtask->file_pages[j] = fpage;
 			if (fpage)
-				score += (PageDirty(fpage) ? 3 : 1);
+			{
+				n_cached++;
+				if (strom_page_is_stale_on_ssd(fpage))
+					n_stale++;
+			}
 		}
 
-		if (score > threshold)
+		if (strom_plan_writeback_chunk(n_pages, n_cached, n_stale))
 		{
 			nr_ram2gpu++;
 			dest_uaddr = block_data + chunk_size * (nchunks - nr_ram2gpu);
+			/* copy to the userspace may block */
+			strom_flush_submission(dtask);
 			retval = __memcpy_ssd2gpu_writeback(dtask, n_pages,
 												file_pos[i],
 												dest_uaddr);
+			if (retval)
+				break;
 			if (block_nums)
 				block_nums[2 * nchunks - nr_ram2gpu] = curr_block_id;
 		}
 		else
 		{
-			__memcpy_ssd2gpu_submit_dma(dtask, n_pages,
-										file_pos[i],
-										dest_offset,
-										&nr_dma_submit,
-										&nr_dma_blocks);
+			retval = __memcpy_ssd2gpu_submit_dma(dtask, n_pages,
+												 file_pos[i],
+												 dest_offset);
+			if (retval)
+				break;
 			if (block_nums)
 				block_nums[nchunks + nr_ssd2gpu] = curr_block_id;
 			dest_offset += chunk_size;
@@ -1759,16 +4626,21 @@ memcpy_ssd2gpu_writeback(strom_dma_task *dtask,
 	/* submit pending SSD2GPU DMA request, if any */
 	if (dtask->nr_blocks > 0)
 	{
-		nr_dma_submit++;
-		nr_dma_blocks += dtask->nr_blocks;
-		submit_ssd2gpu_memcpy(dtask);
+		int		rc = submit_ssd2gpu_memcpy(dtask);
+
+		if (!retval)
+			retval = rc;
 	}
+	if (retval)
+		return retval;
+	if (unlikely(ACCESS_ONCE(dtask->cancelled)))
+		return -ECANCELED;
 
 	Assert(nr_ram2gpu + nr_ssd2gpu == nchunks);
 	*p_nr_ram2gpu = nr_ram2gpu;
 	*p_nr_ssd2gpu = nr_ssd2gpu;
-	*p_nr_dma_submit = nr_dma_submit;
-	*p_nr_dma_blocks = nr_dma_blocks;
+	*p_nr_dma_submit = dtask->nr_dma_submit;
+	*p_nr_dma_blocks = dtask->nr_dma_blocks;
 
 	return 0;
 }
@@ -1829,6 +4701,7 @@ ioctl_memcpy_ssd2gpu_writeback(StromCmd__MemCpySsdToGpuWriteBack __user *uarg,
 		goto out;
 	}
 	karg.dma_task_id = dtask->dma_task_id;
+	dtask->nr_bytes = (size_t)karg.nchunks * karg.block_size;
 	karg.nr_ram2gpu = 0;
 	karg.nr_ssd2gpu = 0;
 	karg.nr_dma_submit = 0;
@@ -1846,10 +4719,9 @@ ioctl_memcpy_ssd2gpu_writeback(StromCmd__MemCpySsdToGpuWriteBack __user *uarg,
 									  &karg.nr_dma_submit,
 									  &karg.nr_dma_blocks);
 	/* no more async jobs shall not acquire the @dtask any more */
-	dtask->frozen = true;
-	barrier();
+	strom_freeze_dma_task(dtask);
 
-	strom_put_dma_task(dtask, 0);
+	strom_put_dma_task(dtask, retval);
 
 	/* write back the results */
 	if (!retval)
@@ -1864,8 +4736,9 @@ ioctl_memcpy_ssd2gpu_writeback(StromCmd__MemCpySsdToGpuWriteBack __user *uarg,
 	}
 	/* synchronization of completion if any error */
 	if (retval)
-		strom_memcpy_ssd2gpu_wait(karg.dma_task_id, NULL,
-								  TASK_UNINTERRUPTIBLE);
+		strom_memcpy_ssd2gpu_wait(karg.dma_task_id,
+								  ioctl_filp->private_data, NULL,
+								  TASK_KILLABLE, MAX_SCHEDULE_TIMEOUT);
 out:
 	kfree(block_nums);
 	kfree(file_pos);
@@ -1886,19 +4759,55 @@ static const char  *strom_proc_signature =		\
 static int
 strom_proc_open(struct inode *inode, struct file *filp)
 {
+	strom_file_context *fcontext;
+
+	fcontext = kzalloc(sizeof(strom_file_context), GFP_KERNEL);
+	if (!fcontext)
+		return -ENOMEM;
+	spin_lock_init(&fcontext->lock);
+	INIT_LIST_HEAD(&fcontext->failed_tasks);
+	fcontext->nr_failed = 0;
+	filp->private_data = fcontext;
+
 	return 0;
 }
 
 static ssize_t
 strom_proc_read(struct file *filp, char __user *buf, size_t len, loff_t *pos)
 {
-	size_t		sig_len = strlen(strom_proc_signature);
+	char		kbuf[1024];
+	size_t		sig_len;
+	int			i;
+
+	/* signature and statistics */
+	sig_len = scnprintf(kbuf, sizeof(kbuf), "%s", strom_proc_signature);
+	sig_len += strom_mempool_stat(&strom_dma_task_mempool,
+								  kbuf + sig_len, sizeof(kbuf) - sig_len);
+	sig_len += strom_mempool_stat(&strom_ssd2gpu_req_mempool,
+								  kbuf + sig_len, sizeof(kbuf) - sig_len);
+	sig_len += strom_mempool_stat(&strom_memcpy_task_mempool,
+								  kbuf + sig_len, sizeof(kbuf) - sig_len);
+	sig_len += strom_mempool_stat(&strom_memcpy_task_large_mempool,
+								  kbuf + sig_len, sizeof(kbuf) - sig_len);
+	sig_len += strom_mempool_stat(&strom_file_pages_mempool,
+								  kbuf + sig_len, sizeof(kbuf) - sig_len);
+	sig_len += scnprintf(kbuf + sig_len, sizeof(kbuf) - sig_len,
+						 "dropped errors: %lld\n",
+						 (long long)atomic64_read(&strom_nr_dropped_errors));
+	sig_len += scnprintf(kbuf + sig_len, sizeof(kbuf) - sig_len,
+						 "RAM2GPU copy: %s\n",
+						 strom_copy_method_names[strom_copy_method]);
+	for (i=0; i < STROM_PATH__NUMS; i++)
+		sig_len += scnprintf(kbuf + sig_len, sizeof(kbuf) - sig_len,
+							 "path cost(%s): %lu nsec/page\n",
+							 strom_path_names[i],
+							 ACCESS_ONCE(strom_path_cost[i]));
 
 	if (*pos >= sig_len)
 		return 0;
 	if (*pos + len >= sig_len)
 		len = sig_len - *pos;
-	if (copy_to_user(buf, strom_proc_signature + *pos, len))
+	if (copy_to_user(buf, kbuf + *pos, len))
 		return -EFAULT;
 	*pos += len;
 
@@ -1908,30 +4817,10 @@ strom_proc_read(struct file *filp, char __user *buf, size_t len, loff_t *pos)
 static int
 strom_proc_release(struct inode *inode, struct file *filp)
 {
-	int			i;
-
-	for (i=0; i < STROM_DMA_TASK_NSLOTS; i++)
-	{
-		spinlock_t		   *lock = &strom_dma_task_locks[i];
-		struct list_head   *slot = &failed_dma_task_slots[i];
-		unsigned long		flags;
-		strom_dma_task	   *dtask;
-		strom_dma_task	   *dnext;
+	/* all the DMA tasks issued on the file are already completed */
+	strom_reclaim_failed_tasks(filp->private_data, 0, true);
+	strom_release_file_context(filp);
 
-		spin_lock_irqsave(lock, flags);
-		list_for_each_entry_safe(dtask, dnext, slot, chain)
-		{
-			if (dtask->ioctl_filp == filp)
-			{
-				prNotice("Unreferenced asynchronous SSD2GPU DMA error "
-						 "(dma_task_id: %lu, status=%ld)",
-						 dtask->dma_task_id, dtask->dma_status);
-				list_del_rcu(&dtask->chain);
-				kfree(dtask);
-			}
-		}
-		spin_unlock_irqrestore(lock, flags);
-	}
 	return 0;
 }
 
@@ -1981,11 +4870,36 @@ strom_proc_ioctl(struct file *ioctl_filp,
 											   ioctl_filp);
 			break;
 
+		case STROM_IOCTL__MEMCPY_SSD2GPU_WAIT_MULTI:
+			retval = ioctl_memcpy_ssd2gpu_wait_multi((void __user *) arg,
+													 ioctl_filp);
+			break;
+
+		case STROM_IOCTL__MEMCPY_SSD2GPU_CANCEL:
+			retval = ioctl_memcpy_ssd2gpu_cancel((void __user *) arg,
+												 ioctl_filp);
+			break;
+
 		case STROM_IOCTL__MEMCPY_SSD2GPU_WRITEBACK:
 			retval = ioctl_memcpy_ssd2gpu_writeback((void __user *) arg,
 													ioctl_filp);
 			break;
 
+		case STROM_IOCTL__MEMCPY_SSD2GPU_SUBMIT:
+			retval = ioctl_memcpy_ssd2gpu_submit((void __user *) arg,
+												 ioctl_filp);
+			break;
+
+		case STROM_IOCTL__SETUP_COMPLETION_RING:
+			retval = ioctl_setup_completion_ring((void __user *) arg,
+												 ioctl_filp);
+			break;
+
+		case STROM_IOCTL__SETUP_EVENTFD:
+			retval = ioctl_setup_eventfd((void __user *) arg,
+										 ioctl_filp);
+			break;
+
 		default:
 			retval = -EINVAL;
 			break;
@@ -1999,6 +4913,7 @@ static const struct file_operations nvme_strom_fops = {
 	.open			= strom_proc_open,
 	.read			= strom_proc_read,
 	.release		= strom_proc_release,
+	.mmap			= strom_mmap_completion_ring,
 	.unlocked_ioctl	= strom_proc_ioctl,
 	.compat_ioctl	= strom_proc_ioctl,
 };
@@ -2022,6 +4937,56 @@ int	__init nvme_strom_init(void)
 		INIT_LIST_HEAD(&failed_dma_task_slots[i]);
 		init_waitqueue_head(&strom_dma_task_waitq[i]);
 	}
+	INIT_DELAYED_WORK(&strom_dma_task_watchdog_work,
+					  strom_dma_task_watchdog);
+
+	/* choose the RAM2GPU copy routine */
+	strom_init_copy_method();
+
+	/* init strom_extent_locks/slots */
+	for (i=0; i < STROM_EXTENT_CACHE_NSLOTS; i++)
+	{
+		spin_lock_init(&strom_extent_locks[i]);
+		INIT_LIST_HEAD(&strom_extent_slots[i]);
+		strom_extent_nitems[i] = 0;
+	}
+
+	/* init memory pools */
+	rc = strom_create_mempool(&strom_dma_task_mempool,
+							  sizeof(strom_dma_task));
+	if (rc)
+		goto error_1;
+	rc = strom_create_mempool(&strom_ssd2gpu_req_mempool,
+							  sizeof(strom_ssd2gpu_request));
+	if (rc)
+		goto error_1;
+	rc = strom_create_mempool(&strom_memcpy_task_mempool,
+							  offsetof(strom_memcpy_task,
+									   file_pages[STROM_MEMCPY_TASK_NPAGES]));
+	if (rc)
+		goto error_1;
+	rc = strom_create_mempool(&strom_memcpy_task_large_mempool,
+							  offsetof(strom_memcpy_task,
+									   file_pages[STROM_RAM2GPU_MAXPAGES]));
+	if (rc)
+		goto error_1;
+	rc = strom_create_mempool(&strom_file_pages_mempool,
+							  sizeof(struct page *) * STROM_RAM2GPU_MAXPAGES);
+	if (rc)
+		goto error_1;
+
+	/* workqueue for RAM2GPU memcpy */
+	if (ram2gpu_max_active <= 0)
+		ram2gpu_max_active = num_online_cpus();
+	ram2gpu_max_active = Min(ram2gpu_max_active, WQ_UNBOUND_MAX_ACTIVE);
+	strom_ram2gpu_wq = alloc_workqueue("nvme_strom_ram2gpu",
+									   WQ_UNBOUND,
+									   ram2gpu_max_active);
+	if (!strom_ram2gpu_wq)
+	{
+		rc = -ENOMEM;
+		goto error_1;
+	}
 
 	/* make "/proc/nvme-strom" entry */
 	nvme_strom_proc = proc_create("nvme-strom",
@@ -2029,25 +4994,48 @@ int	__init nvme_strom_init(void)
 								  NULL,
 								  &nvme_strom_fops);
 	if (!nvme_strom_proc)
-		return -ENOMEM;
+	{
+		rc = -ENOMEM;
+		goto error_1;
+	}
 
 	/* solve mandatory symbols */
 	rc = strom_init_extra_symbols();
 	if (rc)
-	{
-		proc_remove(nvme_strom_proc);
-		return rc;
-	}
+		goto error_2;
 	prNotice("/proc/nvme-strom entry was registered");
 
 	return 0;
+
+error_2:
+	proc_remove(nvme_strom_proc);
+error_1:
+	if (strom_ram2gpu_wq)
+		destroy_workqueue(strom_ram2gpu_wq);
+	strom_destroy_mempool(&strom_file_pages_mempool);
+	strom_destroy_mempool(&strom_memcpy_task_large_mempool);
+	strom_destroy_mempool(&strom_memcpy_task_mempool);
+	strom_destroy_mempool(&strom_ssd2gpu_req_mempool);
+	strom_destroy_mempool(&strom_dma_task_mempool);
+	return rc;
 }
 module_init(nvme_strom_init);
 
 void __exit nvme_strom_exit(void)
 {
+	cancel_delayed_work_sync(&strom_dma_task_watchdog_work);
 	strom_exit_extra_symbols();
 	proc_remove(nvme_strom_proc);
+	strom_cleanup_extent_cache();
+	/* wait for completion of the pending RAM2GPU memcpy */
+	destroy_workqueue(strom_ram2gpu_wq);
+	/* wait for DMA tasks being released by RCU callback */
+	rcu_barrier();
+	strom_destroy_mempool(&strom_file_pages_mempool);
+	strom_destroy_mempool(&strom_memcpy_task_large_mempool);
+	strom_destroy_mempool(&strom_memcpy_task_mempool);
+	strom_destroy_mempool(&strom_ssd2gpu_req_mempool);
+	strom_destroy_mempool(&strom_dma_task_mempool);
 	prNotice("/proc/nvme-strom entry was unregistered");
 }
 module_exit(nvme_strom_exit);
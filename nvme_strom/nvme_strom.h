@@ -13,18 +13,6 @@
 #endif
 #include <asm/ioctl.h>
 
-enum {
-	STROM_IOCTL__CHECK_FILE					= _IO('S',0x80),
-	STROM_IOCTL__MAP_GPU_MEMORY				= _IO('S',0x81),
-	STROM_IOCTL__UNMAP_GPU_MEMORY			= _IO('S',0x82),
-	STROM_IOCTL__LIST_GPU_MEMORY			= _IO('S',0x83),
-	STROM_IOCTL__INFO_GPU_MEMORY			= _IO('S',0x84),
-	STROM_IOCTL__MEMCPY_SSD2GPU				= _IO('S',0x85),
-	STROM_IOCTL__MEMCPY_SSD2GPU_ASYNC		= _IO('S',0x86),
-	STROM_IOCTL__MEMCPY_SSD2GPU_WAIT		= _IO('S',0x87),
-	STROM_IOCTL__MEMCPY_SSD2GPU_WRITEBACK	= _IO('S',0x88),
-};
-
 /* path of ioctl(2) entrypoint */
 #define NVME_STROM_IOCTL_PATHNAME		"/proc/nvme-strom"
 
@@ -80,25 +68,97 @@ typedef struct strom_dma_chunk
 	size_t			offset;		/* in: offset of the destination buffer from
 								 *     the head of mapped GPU memory */
 	size_t			length;		/* in: length of this chunk */
+	size_t			ram2gpu_len;/* out: length copied from the page cache
+								 *      by CPU; the rest is sent by SSD2GPU
+								 *      DMA (not set on errors) */
 } strom_dma_chunk;
 
+/*
+ * If the sync_polling module parameter is set, STROM_IOCTL__MEMCPY_SSD2GPU
+ * runs a single small chunk (up to 64KB) with @timeout_ms == 0 on the fast
+ * path, without a tracked DMA task. It sets @dma_task_id to 0, thus it is
+ * not cancellable, not reported by the watchdog, and posts no event to the
+ * completion ring or eventfd because the caller receives the result by
+ * itself. Only fatal signals break its wait.
+ */
 typedef struct StromCmd__MemCpySsdToGpu
 {
-	unsigned long	dma_task_id;/* out: ID of the DMA task (only async) */
+	unsigned long	dma_task_id;/* out: ID of the DMA task, or 0 on the
+								 *      fast path of the synchronous one */
 	long			status;		/* out: status of the DMA task (only sync) */
+	long			timeout_ms;	/* in: timeout in msec (only sync); 0 to
+								 *     wait infinitely, negative not to
+								 *     wait */
 	unsigned long	handle;		/* in: handler of the mapped GPU memory */
 	int				fdesc;		/* in: descriptor of the source file */
 	int				nchunks;	/* in: number of the source chunks */
-	strom_dma_chunk	chunks[1];	/* in: ...variable length array... */
+	strom_dma_chunk	chunks[1];	/* in/out: ...variable length array... */
 } StromCmd__MemCpySsdToGpu;
 
-/* STROM_IOCTL__MEMCPY_SSD2GPU_WAIT */
+/*
+ * STROM_IOCTL__MEMCPY_SSD2GPU_WAIT
+ *
+ * Error status of the DMA task is returned (and reclaimed) only to the file
+ * handler which issued the task. The others see the task completed without
+ * status once it is not running.
+ */
 typedef struct StromCmd__MemCpySsdToGpuWait
 {
 	unsigned long	dma_task_id;/* in: ID of the DMA task to wait */
 	long			status;		/* out: status of the DMA task */
+	long			timeout_ms;	/* in: timeout in msec; 0 to wait
+								 *     infinitely, negative not to wait */
 } StromCmd__MemCpySsdToGpuWait;
 
+/*
+ * STROM_IOCTL__MEMCPY_SSD2GPU_WAIT_MULTI
+ *
+ * It waits for completion of at least @nr_required DMA tasks out of the
+ * @witems; 1 means 'any', @ntasks means 'all'. @timeout_ms follows the
+ * other commands; 0 means infinite, and negative means no wait.
+ * Completed tasks are marked by @completed, with its @status, even if
+ * ioctl(2) returns ETIMEDOUT or EINTR. Error status of the completed tasks
+ * are reclaimed by this call.
+ */
+typedef struct strom_dma_wait_item
+{
+	unsigned long	dma_task_id;/* in: ID of the DMA task to wait */
+	long			status;		/* out: status of the DMA task */
+	int				completed;	/* out: non-zero, if completed */
+} strom_dma_wait_item;
+
+typedef struct StromCmd__MemCpySsdToGpuWaitMulti
+{
+	long			timeout_ms;	/* in: timeout in msec; 0 to wait
+								 *     infinitely, negative not to wait */
+	int				nr_required;/* in: # of tasks to be completed */
+	int				ntasks;		/* in: number of the @witems */
+	int				ncompleted;	/* out: # of the completed tasks */
+	strom_dma_wait_item witems[1];	/* in/out: ...variable length array... */
+} StromCmd__MemCpySsdToGpuWaitMulti;
+
+/*
+ * STROM_IOCTL__MEMCPY_SSD2GPU_CANCEL
+ *
+ * It cancels the DMA task issued on the same file handler. Requests not
+ * submitted to NVMe-SSD yet are dropped, then the DMA task gets completed
+ * with -ECANCELED status. It returns ENOENT if DMA task is already done.
+ * The @dma_task_id of STROM_IOCTL__MEMCPY_SSD2GPU(_ASYNC|_SUBMIT) is
+ * written back before the requests are submitted, so other threads can
+ * cancel the DMA task while the ioctl(2) is still walking on the chunks.
+ * The synchronous fast path for a small request has no ID (0), thus it is
+ * not cancellable.
+ *
+ * NOTE: NVMe Abort command is never issued. Requests already submitted to
+ * NVMe-SSD run to the end, and the DMA task is completed only after all of
+ * them. There is no upper bound of the time if the device hangs up on a
+ * command; the DMA task is never completed in this case.
+ */
+typedef struct StromCmd__MemCpySsdToGpuCancel
+{
+	unsigned long	dma_task_id;/* in: ID of the DMA task to cancel */
+} StromCmd__MemCpySsdToGpuCancel;
+
 /* STROM_IOCTL__MEMCPY_SSD2GPU_WRITEBACK */
 typedef struct StromCmd__MemCpySsdToGpuWriteBack
 {
@@ -117,4 +177,124 @@ typedef struct StromCmd__MemCpySsdToGpuWriteBack
 	loff_t			file_pos[1];/* in: file position of blocks */
 } StromCmd__MemCpySsdToGpuWriteBack;
 
+/*
+ * STROM_IOCTL__MEMCPY_SSD2GPU_SUBMIT
+ *
+ * It submits multiple asynchronous SSD2GPU DMA tasks by a single ioctl(2),
+ * as if STROM_IOCTL__MEMCPY_SSD2GPU_ASYNC is called for each request.
+ * Each request is individually processed; @status is set to zero and
+ * @dma_task_id is set on success, or negative error code on failure.
+ * Completion of the DMA tasks can be reaped by the completion ring.
+ */
+typedef struct strom_dma_request
+{
+	unsigned long	dma_task_id;/* out: ID of the DMA task */
+	long			status;		/* out: status of the submission */
+	unsigned long	handle;		/* in: handler of the mapped GPU memory */
+	int				fdesc;		/* in: descriptor of the source file */
+	int				nchunks;	/* in: number of the source chunks */
+	strom_dma_chunk __user *chunks;	/* in/out: array of the source chunks */
+} strom_dma_request;
+
+typedef struct StromCmd__MemCpySsdToGpuSubmit
+{
+	int				nrequests;	/* in: number of the requests */
+	int				nsubmitted;	/* out: number of the successful requests */
+	strom_dma_request requests[1];	/* in/out: ...variable length array... */
+} StromCmd__MemCpySsdToGpuSubmit;
+
+/* STROM_IOCTL__SETUP_COMPLETION_RING */
+typedef struct StromCmd__SetupCompletionRing
+{
+	uint32_t		nr_entries;	/* in: number of the ring entries; must be
+								 *     power of 2 */
+	uint32_t		__padding;
+	size_t			mmap_length;/* out: length to be mmap(2)'ed */
+} StromCmd__SetupCompletionRing;
+
+/*
+ * Completion ring
+ *
+ * Once STROM_IOCTL__SETUP_COMPLETION_RING is called, kernel posts an event
+ * for each DMA task issued on the file handler when it gets completed.
+ * Application can mmap(2) the ring (read-only, offset 0, @mmap_length) and
+ * reap completions without system calls.
+ *
+ * The ring is never blocked by the consumer; kernel writes the N-th event
+ * on events[N & mask] then increments @tail. Application shall keep its own
+ * head position, read events between the head and @tail, then re-check
+ * @tail. If @tail goes ahead more than @nr_entries from the head, some
+ * events were overwritten; application needs to fall back to the
+ * STROM_IOCTL__MEMCPY_SSD2GPU_WAIT for the outstanding DMA tasks.
+ * Kernel never waits for the consumer, so entries not yet read are
+ * overwritten whenever more than @nr_entries events are posted since the
+ * head, regardless of the number of concurrent DMA tasks. Advance of @tail
+ * by more than @nr_entries is the only way to detect it.
+ *
+ * Status of the failed DMA tasks are still kept in kernel, until
+ * STROM_IOCTL__MEMCPY_SSD2GPU_WAIT reclaims it or the file is closed.
+ * Events of unknown dma_task_id (e.g, the ioctl(2) which issued it failed)
+ * shall be ignored.
+ */
+typedef struct strom_completion_event
+{
+	uint64_t		dma_task_id;/* ID of the completed DMA task */
+	int64_t			status;		/* status of the DMA task */
+	uint64_t		nr_bytes;	/* length requested to the DMA task */
+} strom_completion_event;
+
+typedef struct strom_completion_ring
+{
+	volatile uint32_t tail;		/* number of events posted */
+	uint32_t		nr_entries;	/* number of the ring entries */
+	uint32_t		mask;		/* nr_entries - 1 */
+	uint32_t		__padding;
+	strom_completion_event events[1];	/* ...variable length array... */
+} strom_completion_ring;
+
+/*
+ * STROM_IOCTL__SETUP_EVENTFD
+ *
+ * It registers an eventfd(2) on the file handler. The eventfd is signaled
+ * for each completion of the DMA tasks issued on the file handler, so
+ * application can multiplex many DMA tasks using poll(2) or epoll(7).
+ */
+typedef struct StromCmd__SetupEventFd
+{
+	int				fdesc;		/* in: file descriptor of the eventfd */
+} StromCmd__SetupEventFd;
+
+/*
+ * ioctl(2) commands
+ *
+ * Commands added or changed since the first release encode the size of
+ * their argument in the command number, so a binary built with another
+ * layout of the argument fails with ENOTTY, instead of misreading it.
+ * The others keep _IO() for compatibility of the existing binaries.
+ */
+enum {
+	STROM_IOCTL__CHECK_FILE					= _IO('S',0x80),
+	STROM_IOCTL__MAP_GPU_MEMORY				= _IO('S',0x81),
+	STROM_IOCTL__UNMAP_GPU_MEMORY			= _IO('S',0x82),
+	STROM_IOCTL__LIST_GPU_MEMORY			= _IO('S',0x83),
+	STROM_IOCTL__INFO_GPU_MEMORY			= _IO('S',0x84),
+	STROM_IOCTL__MEMCPY_SSD2GPU				= _IOWR('S',0x85,
+													StromCmd__MemCpySsdToGpu),
+	STROM_IOCTL__MEMCPY_SSD2GPU_ASYNC		= _IOWR('S',0x86,
+													StromCmd__MemCpySsdToGpu),
+	STROM_IOCTL__MEMCPY_SSD2GPU_WAIT		= _IOWR('S',0x87,
+											StromCmd__MemCpySsdToGpuWait),
+	STROM_IOCTL__MEMCPY_SSD2GPU_WRITEBACK	= _IO('S',0x88),
+	STROM_IOCTL__SETUP_COMPLETION_RING		= _IOWR('S',0x89,
+											StromCmd__SetupCompletionRing),
+	STROM_IOCTL__MEMCPY_SSD2GPU_SUBMIT		= _IOWR('S',0x8a,
+											StromCmd__MemCpySsdToGpuSubmit),
+	STROM_IOCTL__SETUP_EVENTFD				= _IOWR('S',0x8b,
+											StromCmd__SetupEventFd),
+	STROM_IOCTL__MEMCPY_SSD2GPU_WAIT_MULTI	= _IOWR('S',0x8c,
+										StromCmd__MemCpySsdToGpuWaitMulti),
+	STROM_IOCTL__MEMCPY_SSD2GPU_CANCEL		= _IOWR('S',0x8d,
+											StromCmd__MemCpySsdToGpuCancel),
+};
+
 #endif /* NVME_STROM_H */
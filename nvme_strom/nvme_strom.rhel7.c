@@ -15,6 +15,10 @@ struct strom_ssd2gpu_request {
 	strom_dma_task	   *dtask;
 	struct request	   *req;
 	struct nvme_iod	   *iod;
+	int					cpu;	/* CPU which allocated the request */
+	int					nr_inflight;/* # of requests in-flight on the CPU */
+	size_t				length;	/* length of the DMA request */
+	u64					submit_ns;	/* time of the request submission */
 };
 typedef struct strom_ssd2gpu_request	strom_ssd2gpu_request;
 
@@ -64,6 +68,16 @@ struct nvme_cmd_info {
 	struct nvme_iod iod[0];
 };
 
+/* -- copy from block/blk-mq.h; only the leading fields we reference -- */
+struct blk_mq_ctx {
+	struct {
+		spinlock_t		lock;
+		struct list_head	rq_list;
+	}  ____cacheline_aligned_in_smp;
+
+	unsigned int		cpu;
+};
+
 static void
 nvme_callback_async_read_cmd(struct nvme_queue *nvmeq, void *ctx,
 							 struct nvme_completion *cqe)
@@ -78,11 +92,26 @@ nvme_callback_async_read_cmd(struct nvme_queue *nvmeq, void *ctx,
 	 */
 	prDebug("DMA Req Completed status=%d result=%u", dma_status, dma_result);
 
+	/*
+	 * Update the cost of SSD2GPU. The concurrent requests share the device,
+	 * so the latency is divided by the number of in-flight requests, like
+	 * RAM2GPU divides by the number of active jobs. It counts the requests
+	 * charged to the same CPU only, not to pay a global atomic per command.
+	 */
+	if (dma_status == NVME_SC_SUCCESS)
+		strom_update_path_cost(STROM_PATH__SSD2GPU,
+							   ktime_to_ns(ktime_get()) -
+							   ssd2gpu_req->submit_ns,
+							   ssd2gpu_req->length *
+							   ssd2gpu_req->nr_inflight);
+
 	/* release resources and wake up waiter */
-	__nvme_free_iod(nvmeq->dev, ssd2gpu_req->iod);
+	atomic_dec(&per_cpu(strom_hwq_inflight, ssd2gpu_req->cpu));
+	if (ssd2gpu_req->iod)
+		__nvme_free_iod(nvmeq->dev, ssd2gpu_req->iod);
 	blk_mq_free_request(ssd2gpu_req->req);
 	strom_put_dma_task(ssd2gpu_req->dtask, dma_status);
-	kfree(ssd2gpu_req);
+	strom_mempool_free(&strom_ssd2gpu_req_mempool, ssd2gpu_req);
 }
 
 /* -- copy from nvme-core.c -- */
@@ -120,6 +149,274 @@ nvme_submit_cmd(struct nvme_queue *nvmeq, struct nvme_command *cmd)
 	return ret;
 }
 
+/*
+ * nvme_ring_doorbell - ring the doorbell of the queue if any commands of
+ * the DMA task are staged but not notified to the controller yet.
+ */
+static void
+nvme_ring_doorbell(strom_dma_task *dtask)
+{
+	struct nvme_queue  *nvmeq = dtask->db_nvmeq;
+	unsigned long		flags;
+
+	if (!nvmeq)
+		return;
+	spin_lock_irqsave(&nvmeq->q_lock, flags);
+	writel(nvmeq->sq_tail, nvmeq->q_db);
+	spin_unlock_irqrestore(&nvmeq->q_lock, flags);
+
+	dtask->db_nvmeq = NULL;
+	dtask->db_pending = 0;
+}
+
+/*
+ * nvme_stage_cmd - Copy a command into a queue, but ring the doorbell only
+ * when @doorbell_batch commands are staged. A doorbell write is an MMIO
+ * access under the q_lock, so it is much more expensive than memcpy to the
+ * submission queue. Caller has to ring the doorbell using
+ * nvme_ring_doorbell() on the tail of submission.
+ * Note that submission by the nvme driver also notifies our commands to
+ * the controller, because it writes the latest sq_tail to the doorbell.
+ */
+static void
+nvme_stage_cmd(strom_dma_task *dtask, struct nvme_queue *nvmeq,
+			   struct nvme_command *cmd)
+{
+	unsigned long	flags;
+	u16				tail;
+
+	if (dtask->db_nvmeq && dtask->db_nvmeq != nvmeq)
+		nvme_ring_doorbell(dtask);
+
+	spin_lock_irqsave(&nvmeq->q_lock, flags);
+	tail = nvmeq->sq_tail;
+	memcpy(&nvmeq->sq_cmds[tail], cmd, sizeof(*cmd));
+	if (++tail == nvmeq->q_depth)
+		tail = 0;
+	nvmeq->sq_tail = tail;
+	if (++dtask->db_pending >= doorbell_batch)
+	{
+		writel(tail, nvmeq->q_db);
+		dtask->db_nvmeq = NULL;
+		dtask->db_pending = 0;
+	}
+	else
+		dtask->db_nvmeq = nvmeq;
+	spin_unlock_irqrestore(&nvmeq->q_lock, flags);
+}
+
+/*
+ * SGL (Scatter Gather List) descriptor of NVMe 1.1 or later.
+ * RHEL7 kernel does not have its definition, so we define it by ourself.
+ */
+struct strom_sgl_desc {
+	__le64		addr;
+	__le32		length;
+	__u8		rsvd[3];
+	__u8		type;
+};
+typedef struct strom_sgl_desc	strom_sgl_desc;
+
+#define STROM_SGL_FMT_DATA_DESC			0x00
+#define STROM_SGL_FMT_LAST_SEG_DESC		0x30
+#define STROM_CMD_SGL_METABUF			0x40	/* PSDT=01b */
+
+/*
+ * nvme_setup_sgls - an alternative of nvme_setup_prps, but sets up SGL
+ * descriptors. Physically contiguous region is described with a Data Block
+ * descriptor, so it does not need any extra buffer as long as destination
+ * GPU pages are contiguous. Elsewhere, a segment of descriptors shall be
+ * allocated from the DMA pool of PRP list, then @dptr points the segment.
+ * It returns @total_len on success, or zero if the request is too much
+ * fragmented to describe with a single segment.
+ */
+static int
+nvme_setup_sgls(struct nvme_dev *dev, struct nvme_iod *iod,
+				int total_len, strom_sgl_desc *dptr, gfp_t gfp)
+{
+	struct scatterlist *sg;
+	strom_sgl_desc	   *sgl_list;
+	struct dma_pool	   *pool;
+	dma_addr_t			sgl_dma;
+	dma_addr_t			dma_addr;
+	unsigned int		dma_len;
+	int					nsegs = 0;
+	int					i, j;
+
+	/* count number of the physically contiguous segments */
+	dma_addr = 0;
+	dma_len = 0;
+	for_each_sg(iod->sg, sg, iod->nents, i)
+	{
+		if (!nsegs || dma_addr + dma_len != sg_dma_address(sg))
+		{
+			nsegs++;
+			dma_addr = sg_dma_address(sg);
+			dma_len = 0;
+		}
+		dma_len += sg_dma_len(sg);
+	}
+
+	memset(dptr, 0, sizeof(strom_sgl_desc));
+	if (nsegs == 1)
+	{
+		dptr->addr		= cpu_to_le64(sg_dma_address(iod->sg));
+		dptr->length	= cpu_to_le32(total_len);
+		dptr->type		= STROM_SGL_FMT_DATA_DESC;
+		return total_len;
+	}
+
+	/* a segment of the descriptors is needed */
+	if (nsegs <= 256 / sizeof(strom_sgl_desc))
+	{
+		pool = dev->prp_small_pool;
+		iod->npages = 0;
+	}
+	else if (nsegs <= dev->page_size / sizeof(strom_sgl_desc))
+	{
+		pool = dev->prp_page_pool;
+		iod->npages = 1;
+	}
+	else
+		return 0;
+
+	sgl_list = dma_pool_alloc(pool, gfp, &sgl_dma);
+	if (!sgl_list)
+	{
+		iod->npages = -1;
+		return 0;
+	}
+	((void **)((void *)iod + iod->offset))[0] = sgl_list;
+	iod->first_dma = sgl_dma;
+
+	j = -1;
+	for_each_sg(iod->sg, sg, iod->nents, i)
+	{
+		if (j < 0 ||
+			le64_to_cpu(sgl_list[j].addr) +
+			le32_to_cpu(sgl_list[j].length) != sg_dma_address(sg))
+		{
+			j++;
+			memset(&sgl_list[j], 0, sizeof(strom_sgl_desc));
+			sgl_list[j].addr	= cpu_to_le64(sg_dma_address(sg));
+			sgl_list[j].type	= STROM_SGL_FMT_DATA_DESC;
+		}
+		le32_add_cpu(&sgl_list[j].length, sg_dma_len(sg));
+	}
+	Assert(j + 1 == nsegs);
+
+	dptr->addr		= cpu_to_le64(sgl_dma);
+	dptr->length	= cpu_to_le32(nsegs * sizeof(strom_sgl_desc));
+	dptr->type		= STROM_SGL_FMT_LAST_SEG_DESC;
+
+	return total_len;
+}
+
+/*
+ * special completion handlers and nvme_process_cq
+ */
+#define CMD_CTX_BASE		((void *)POISON_POINTER_DELTA)
+#define CMD_CTX_CANCELLED	(0x30C + CMD_CTX_BASE)
+#define CMD_CTX_COMPLETED	(0x310 + CMD_CTX_BASE)
+#define CMD_CTX_INVALID		(0x314 + CMD_CTX_BASE)
+
+static void
+special_completion(struct nvme_queue *nvmeq, void *ctx,
+				   struct nvme_completion *cqe)
+{
+	if (ctx == CMD_CTX_CANCELLED)
+		return;
+	if (ctx == CMD_CTX_COMPLETED)
+	{
+		dev_warn(nvmeq->q_dmadev,
+				 "completed id %d twice on queue %d\n",
+				 cqe->command_id, le16_to_cpup(&cqe->sq_id));
+		return;
+	}
+	if (ctx == CMD_CTX_INVALID)
+	{
+		dev_warn(nvmeq->q_dmadev,
+				 "invalid id %d completed on queue %d\n",
+				 cqe->command_id, le16_to_cpup(&cqe->sq_id));
+		return;
+	}
+	dev_warn(nvmeq->q_dmadev, "Unknown special completion %p\n", ctx);
+}
+
+static void *
+nvme_finish_cmd(struct nvme_queue *nvmeq, int tag, nvme_completion_fn *fn)
+{
+	struct request *rq;
+	struct nvme_cmd_info *cmd;
+	void *ctx;
+
+	if (tag >= nvmeq->q_depth) {
+		*fn = special_completion;
+		return CMD_CTX_INVALID;
+	}
+	rq = blk_mq_tag_to_rq(*nvmeq->tags, tag);
+	cmd = blk_mq_rq_to_pdu(rq);
+	if (fn)
+		*fn = cmd->fn;
+	ctx = cmd->ctx;
+	cmd->fn = special_completion;
+	cmd->ctx = CMD_CTX_COMPLETED;
+	return ctx;
+}
+
+static int
+nvme_process_cq(struct nvme_queue *nvmeq)
+{
+	u16 head, phase;
+
+	head = nvmeq->cq_head;
+	phase = nvmeq->cq_phase;
+
+	for (;;) {
+		void *ctx;
+		nvme_completion_fn fn;
+		struct nvme_completion cqe = nvmeq->cqes[head];
+		if ((le16_to_cpu(cqe.status) & 1) != phase)
+			break;
+		nvmeq->sq_head = le16_to_cpu(cqe.sq_head);
+		if (++head == nvmeq->q_depth) {
+			head = 0;
+			phase = !phase;
+		}
+		ctx = nvme_finish_cmd(nvmeq, cqe.command_id, &fn);
+		fn(nvmeq, ctx, &cqe);
+	}
+
+	if (head == nvmeq->cq_head && phase == nvmeq->cq_phase)
+		return 0;
+
+	writel(head, nvmeq->q_db + nvmeq->dev->db_stride);
+	nvmeq->cq_head = head;
+	nvmeq->cq_phase = phase;
+
+	nvmeq->cqe_seen = 1;
+	return 1;
+}
+
+/*
+ * nvme_poll_queue - reap the completion queue opportunistically.
+ * It does not suppress the interrupt; the interrupt handler also processes
+ * the completion queue under the q_lock, so we don't need to care about
+ * the concurrent completion.
+ */
+static int
+nvme_poll_queue(struct nvme_queue *nvmeq)
+{
+	unsigned long	flags;
+	int				retval;
+
+	spin_lock_irqsave(&nvmeq->q_lock, flags);
+	retval = nvme_process_cq(nvmeq);
+	spin_unlock_irqrestore(&nvmeq->q_lock, flags);
+
+	return retval;
+}
+
 static void
 nvme_set_info(struct nvme_cmd_info *cmd, void *ctx, nvme_completion_fn handler)
 {
@@ -133,14 +430,25 @@ nvme_set_info(struct nvme_cmd_info *cmd, void *ctx, nvme_completion_fn handler)
  * nvme_submit_io_cmd_async - It submits an I/O command of NVME-SSD, and then
  * returns to the caller immediately. Callback will put the strom_dma_task,
  * thus, strom_memcpy_ssd2gpu_wait() allows synchronization of DMA completion.
+ * Caller has to acquire a reference of the strom_dma_task; which is passed
+ * to the callback on success.
+ * Request is allocated on the hardware queue associated with the current
+ * CPU, so the caller can choose the hardware queue by the CPU to run.
+ * If @is_staged, doorbell shall be rung later by nvme_ring_doorbell(), so
+ * only the submitter of the DMA task can use this mode.
+ * If @iod is NULL, @prp1 and @prp2 are already set up by the caller.
  */
 static int
-nvme_submit_async_read_cmd(strom_dma_task *dtask, struct nvme_iod *iod)
+nvme_submit_async_read_cmd(strom_dma_task *dtask, struct nvme_iod *iod,
+						   u64 prp1, u64 prp2,
+						   sector_t src_block, unsigned int nr_blocks,
+						   bool is_staged)
 {
 	struct nvme_ns		   *nvme_ns = dtask->nvme_ns;
 	struct request		   *req;
 	struct nvme_cmd_info   *cmd_rq;
 	struct nvme_command		cmd;
+	strom_sgl_desc			sgl_dptr;
 	strom_ssd2gpu_request  *ssd2gpu_req;
 	size_t					length;
 	int						prp_len;
@@ -152,41 +460,93 @@ nvme_submit_async_read_cmd(strom_dma_task *dtask, struct nvme_iod *iod)
 
 	Assert(dtask->blocksz_shift >= nvme_ns->lba_shift);
 	/* setup scatter-gather list */
-	length  = (dtask->nr_blocks << dtask->blocksz_shift);
-	nblocks = (dtask->nr_blocks << (dtask->blocksz_shift -
-									nvme_ns->lba_shift)) - 1;
+	length  = (nr_blocks << dtask->blocksz_shift);
+	nblocks = (nr_blocks << (dtask->blocksz_shift -
+							 nvme_ns->lba_shift)) - 1;
 	if (nblocks > 0xffff)
 		return -EINVAL;
 	prDebug("src_block=%zu start_sect=%zu nblocks=%u",
-			(size_t)dtask->src_block,
+			(size_t)src_block,
 			(size_t)dtask->start_sect,
 			nblocks);
-	slba = dtask->src_block << (dtask->blocksz_shift -
-								nvme_ns->lba_shift);
+	slba = src_block << (dtask->blocksz_shift -
+						 nvme_ns->lba_shift);
 	slba += dtask->start_sect;
 
+	/*
+	 * NOTE: Staged commands hold the tags and their timers are running, so
+	 * they have to be notified prior to the allocation of PRP list.
+	 */
+	if (is_staged && iod)
+		nvme_ring_doorbell(dtask);
+
 	/* setup scatter-gather list */
-	prp_len = __nvme_setup_prps(nvme_ns->dev, iod, length, GFP_KERNEL);
+	if (!iod)
+		prp_len = length;	/* PRPs are already set up */
+	else if (use_sgl)
+		prp_len = nvme_setup_sgls(nvme_ns->dev, iod, length,
+								  &sgl_dptr, GFP_KERNEL);
+	else
+		prp_len = 0;
+	/* PRPs, if SGL is not available */
+	if (prp_len != length)
+		prp_len = __nvme_setup_prps(nvme_ns->dev, iod, length, GFP_KERNEL);
+	else if (iod)
+		iod->private = 1;	/* mark SGL is used */
 	if (prp_len != length)
 		return -ENOMEM;
 
 	/* submit an asynchronous command */
-	ssd2gpu_req = kzalloc(sizeof(strom_ssd2gpu_request), GFP_KERNEL);
+	ssd2gpu_req = strom_mempool_alloc_nowait(&strom_ssd2gpu_req_mempool);
+	if (!ssd2gpu_req)
+	{
+		if (is_staged)
+			nvme_ring_doorbell(dtask);
+		ssd2gpu_req = strom_mempool_alloc(&strom_ssd2gpu_req_mempool);
+	}
 	if (!ssd2gpu_req)
 		return -ENOMEM;
 
-	req = blk_mq_alloc_request(nvme_ns->queue,
-							   WRITE,
-							   GFP_KERNEL|__GFP_WAIT,
-							   false);
+	/*
+	 * NOTE: staged commands hold the tags until the doorbell is rung, so
+	 * we must not sleep for a free tag with the pending doorbell.
+	 */
+	req = NULL;
+	if (is_staged && dtask->db_nvmeq)
+	{
+		req = blk_mq_alloc_request(nvme_ns->queue,
+								   WRITE,
+								   GFP_NOWAIT,
+								   false);
+		if (IS_ERR_OR_NULL(req))
+		{
+			nvme_ring_doorbell(dtask);
+			req = NULL;
+		}
+	}
+	if (!req)
+		req = blk_mq_alloc_request(nvme_ns->queue,
+								   WRITE,
+								   GFP_KERNEL|__GFP_WAIT,
+								   false);
 	if (IS_ERR(req))
 	{
-		kfree(ssd2gpu_req);
+		strom_mempool_free(&strom_ssd2gpu_req_mempool, ssd2gpu_req);
 		return PTR_ERR(req);
 	}
 	ssd2gpu_req->req = req;
 	ssd2gpu_req->iod = iod;
-	ssd2gpu_req->dtask = strom_get_dma_task(dtask);
+	ssd2gpu_req->dtask = dtask;
+	/*
+	 * NOTE: blk_mq_alloc_request() may sleep and the caller may migrate,
+	 * so the CPU to be charged is the one of the software queue that the
+	 * request is allocated from, not the current one.
+	 */
+	ssd2gpu_req->cpu = req->mq_ctx->cpu;
+	ssd2gpu_req->nr_inflight =
+		atomic_inc_return(&per_cpu(strom_hwq_inflight, ssd2gpu_req->cpu));
+	ssd2gpu_req->length = length;
+	ssd2gpu_req->submit_ns = ktime_to_ns(ktime_get());
 
 	/* setup READ command */
 	if (req->cmd_flags & REQ_FUA)
@@ -198,11 +558,28 @@ nvme_submit_async_read_cmd(strom_dma_task *dtask, struct nvme_iod *iod)
 
 	memset(&cmd, 0, sizeof(struct nvme_command));
 	cmd.rw.opcode		= nvme_cmd_read;
-	cmd.rw.flags		= 0;	/* we use PRPs, rather than SGL */
 	cmd.rw.command_id	= req->tag;
 	cmd.rw.nsid			= cpu_to_le32(nvme_ns->ns_id);
-	cmd.rw.prp1			= cpu_to_le64(sg_dma_address(iod->sg));
-	cmd.rw.prp2			= cpu_to_le64(iod->first_dma);
+	if (!iod)
+	{
+		cmd.rw.flags	= 0;	/* PRPs from the PRP table */
+		cmd.rw.prp1		= cpu_to_le64(prp1);
+		cmd.rw.prp2		= cpu_to_le64(prp2);
+	}
+	else if (iod->private)
+	{
+		/* SGL descriptor occupies both of PRP entries */
+		BUILD_BUG_ON(sizeof(strom_sgl_desc) != (sizeof(cmd.rw.prp1) +
+												sizeof(cmd.rw.prp2)));
+		cmd.rw.flags	= STROM_CMD_SGL_METABUF;
+		memcpy(&cmd.rw.prp1, &sgl_dptr, sizeof(strom_sgl_desc));
+	}
+	else
+	{
+		cmd.rw.flags	= 0;	/* we use PRPs, rather than SGL */
+		cmd.rw.prp1		= cpu_to_le64(sg_dma_address(iod->sg));
+		cmd.rw.prp2		= cpu_to_le64(iod->first_dma);
+	}
 	cmd.rw.metadata		= 0;	/* XXX integrity check, if needed */
 	cmd.rw.slba			= cpu_to_le64(slba);
 	cmd.rw.length		= cpu_to_le16(nblocks);
@@ -215,7 +592,16 @@ nvme_submit_async_read_cmd(strom_dma_task *dtask, struct nvme_iod *iod)
 	 */
 	cmd_rq = blk_mq_rq_to_pdu(req);
 	nvme_set_info(cmd_rq, ssd2gpu_req, nvme_callback_async_read_cmd);
-	nvme_submit_cmd(cmd_rq->nvmeq, &cmd);
+	if (is_staged)
+	{
+		if (!dtask->poll_nvmeq)
+			dtask->poll_nvmeq = cmd_rq->nvmeq;
+		else if (dtask->poll_nvmeq != cmd_rq->nvmeq)
+			dtask->no_polling = true;
+		nvme_stage_cmd(dtask, cmd_rq->nvmeq, &cmd);
+	}
+	else
+		nvme_submit_cmd(cmd_rq->nvmeq, &cmd);
 
 	return retval;
 }
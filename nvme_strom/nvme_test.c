@@ -50,7 +50,7 @@ static pthread_mutex_t	buffer_lock;
  * nvme_strom_ioctl - entrypoint of NVME-Strom
  */
 static int
-nvme_strom_ioctl(int cmd, const void *arg)
+nvme_strom_ioctl(unsigned long cmd, const void *arg)
 {
 	static __thread int fdesc_nvme_strom = -1;
 